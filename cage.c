@@ -12,6 +12,7 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -64,6 +65,8 @@
 #include "clipboard_sync.h"
 #include "pointer_constraints.h"
 #include "ipc.h"
+#include "log_ring.h"
+#include "shared_state.h"
 #if CAGE_HAS_XWAYLAND
 #include "xwayland.h"
 #endif
@@ -236,21 +239,29 @@ usage(FILE *file, const char *cage)
 		" -d\t Don't draw client side decorations, when possible\n"
 		" -D\t Enable debug logging\n"
 		" -h\t Display this help message\n"
+		" -z seconds Trickle frames once nothing changed for that long\n"
 		" -m extend Extend the display across all connected outputs (default)\n"
 		" -m last Use only the last connected output\n"
 		" -s\t Allow VT switching\n"
 		" -v\t Show the version number and exit\n"
 		" -i app-id Set application idendifier for the toplevel window\n"
+		" -P\t Use a SOCK_SEQPACKET socket for IPC\n"
+		" -S path Bind the IPC socket at path\n"
+		" -r [output=]<hz|auto> Force a refresh at that rate, on every output or the named one\n"
+		" -M <ms|auto> Render at most that long before the next vblank (default: right after the last one)\n"
+		" -f fps\t Render at most that many frames per second\n"
+		" -F <ms|auto> Delay frame events to applications by that long after a commit\n"
+		" -o hz\t Pace clients at that rate while the host hides the output (default: %d, 0 to disable)\n"
 		"\n"
 		" Use -- when you want to pass arguments to APPLICATION\n",
-		cage);
+		cage, OFFSCREEN_REFRESH_DEFAULT_HZ);
 }
 
 static bool
 parse_args(struct cg_server *server, int argc, char *argv[])
 {
 	int c;
-	while ((c = getopt(argc, argv, "dDhm:svi:")) != -1) {
+	while ((c = getopt(argc, argv, "dDf:F:hm:M:svi:Po:r:S:z:")) != -1) {
 		switch (c) {
 		case 'd':
 			server->xdg_decoration = true;
@@ -274,6 +285,67 @@ parse_args(struct cg_server *server, int argc, char *argv[])
 		case 'i':
 			server->app_id = optarg;
 			break;
+		case 'P':
+			server->ipc_seqpacket = true;
+			break;
+		case 'S':
+			server->ipc_socket = optarg;
+			break;
+		case 'f':
+			if (!output_parse_refresh(optarg, &server->max_fps) || server->max_fps == FORCED_REFRESH_AUTO) {
+				fprintf(stderr, "Invalid frame rate: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'F':
+			if (!output_parse_delay(optarg, &server->frame_done_delay_ms)) {
+				fprintf(stderr, "Invalid frame done delay: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'M':
+			if (!output_parse_delay(optarg, &server->max_render_time_ms)) {
+				fprintf(stderr, "Invalid max render time: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'o':
+			if (!output_parse_refresh(optarg, &server->offscreen_hz) ||
+			    server->offscreen_hz == FORCED_REFRESH_AUTO) {
+				fprintf(stderr, "Invalid offscreen rate: %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'r': {
+			struct cg_refresh_rule rule = {0};
+			const char *rate = optarg;
+			char *sep = strchr(optarg, '=');
+			if (sep) {
+				*sep = '\0';
+				rule.output = optarg;
+				rate = sep + 1;
+			}
+			if (!output_parse_refresh(rate, &rule.hz)) {
+				fprintf(stderr, "Invalid refresh rate: %s\n", rate);
+				return false;
+			}
+			struct cg_refresh_rule *slot = wl_array_add(&server->refresh_rules, sizeof(rule));
+			if (!slot) {
+				return false;
+			}
+			*slot = rule;
+			break;
+		}
+		case 'z': {
+			char *end;
+			long timeout = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || timeout < 0 || timeout > INT_MAX) {
+				fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+				return false;
+			}
+			server->idle_timeout_sec = timeout;
+			break;
+		}
 		case 'v':
 			fprintf(stdout, "Cage version " CAGE_VERSION "\n");
 			exit(0);
@@ -336,7 +408,7 @@ static struct wl_registry_listener remote_registry_listener = {
 int
 main(int argc, char *argv[])
 {
-	struct cg_server server = {.log_level = WLR_INFO};
+	struct cg_server server = {.log_level = WLR_INFO, .offscreen_hz = OFFSCREEN_REFRESH_DEFAULT_HZ};
 	struct wl_event_source *sigchld_source = NULL;
 	pid_t pid = 0;
 	int ret = 0, app_ret = 0;
@@ -349,17 +421,19 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
-	wlr_log_init(server.log_level, NULL);
+	log_ring_init(server.log_level);
 
 	/* Wayland requires XDG_RUNTIME_DIR to be set. */
 	if (!getenv("XDG_RUNTIME_DIR")) {
 		wlr_log(WLR_ERROR, "XDG_RUNTIME_DIR is not set in the environment");
+		log_ring_finish();
 		return 1;
 	}
 
 	server.wl_display = wl_display_create();
 	if (!server.wl_display) {
 		wlr_log(WLR_ERROR, "Cannot allocate a Wayland display");
+		log_ring_finish();
 		return 1;
 	}
 
@@ -444,6 +518,10 @@ main(int argc, char *argv[])
 		goto end;
 	}
 
+	/* Must exist before the first output shows up, as outputs claim
+	 * their slot in the shared state page when they are created. */
+	shared_state_init(&server);
+
 	/* Configure a listener to be notified when new outputs are
 	 * available on the backend. We use this only to detect the
 	 * first output and ignore subsequent outputs. */
@@ -656,13 +734,15 @@ main(int argc, char *argv[])
 	}
 #endif
 
+	/* Before spawning the client, so it inherits CAGE_IPC_SOCKET. */
+	ipc_init(&server, socket);
+
 	if (optind < argc && !spawn_primary_client(&server, argv + optind, &pid, &sigchld_source)) {
 		ret = 1;
 		goto end;
 	}
 
 	seat_center_cursor(server.seat);
-	ipc_init(&server);
 	wl_display_run(server.wl_display);
 
 #if CAGE_HAS_XWAYLAND
@@ -682,9 +762,13 @@ end:
 	if (sigchld_source) {
 		wl_event_source_remove(sigchld_source);
 	}
+	ipc_finish(&server);
+	shared_state_finish(&server);
 	seat_destroy(server.seat);
 	/* This function is not null-safe, but we only ever get here
 	   with a proper wl_display. */
 	wl_display_destroy(server.wl_display);
+	wl_array_release(&server.refresh_rules);
+	log_ring_finish();
 	return ret;
 }
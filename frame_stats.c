@@ -0,0 +1,88 @@
+/*
+ * Cage: A Wayland kiosk.
+ *
+ * See the LICENSE file accompanying this file.
+ */
+
+#include <wlr/types/wlr_output.h>
+
+#include "frame_stats.h"
+
+static void
+histogram_add(struct cg_histogram *histogram, uint64_t nsec)
+{
+	uint64_t usec = nsec / 1000;
+	uint8_t bucket = 0;
+	while (usec > 1 && bucket < CG_FRAME_STATS_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+
+	if (histogram->count == CG_FRAME_STATS_WINDOW) {
+		histogram->buckets[histogram->ring[histogram->next]]--;
+	} else {
+		histogram->count++;
+	}
+	histogram->ring[histogram->next] = bucket;
+	histogram->next = (histogram->next + 1) % CG_FRAME_STATS_WINDOW;
+	histogram->buckets[bucket]++;
+}
+
+/* Upper bound in nanoseconds of the bucket holding the given percentile,
+ * or 0 if there are no samples. */
+uint64_t
+frame_stats_histogram_percentile(const struct cg_histogram *histogram, uint32_t percent)
+{
+	if (histogram->count == 0) {
+		return 0;
+	}
+
+	uint32_t rank = (histogram->count * percent + 99) / 100;
+	uint32_t seen = 0;
+	uint8_t bucket = 0;
+	for (; bucket < CG_FRAME_STATS_BUCKETS - 1; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return (uint64_t) 2000 << bucket;
+}
+
+void
+frame_stats_frame(struct cg_frame_stats *stats, uint64_t now_nsec)
+{
+	if (stats->last_frame_nsec != 0 && now_nsec > stats->last_frame_nsec) {
+		histogram_add(&stats->frame_interval, now_nsec - stats->last_frame_nsec);
+	}
+	stats->last_frame_nsec = now_nsec;
+	stats->frames++;
+}
+
+void
+frame_stats_commit(struct cg_frame_stats *stats, uint64_t start_nsec, uint64_t end_nsec, bool committed)
+{
+	if (!committed) {
+		stats->skipped++;
+		return;
+	}
+
+	histogram_add(&stats->commit_duration, end_nsec - start_nsec);
+	stats->pending_commit_nsec = start_nsec;
+}
+
+void
+frame_stats_present(struct cg_frame_stats *stats, const struct wlr_output_event_present *event)
+{
+	if (stats->pending_commit_nsec == 0) {
+		return;
+	}
+
+	if (event->presented && event->when) {
+		uint64_t when = (uint64_t) event->when->tv_sec * 1000000000 + event->when->tv_nsec;
+		if (when > stats->pending_commit_nsec) {
+			histogram_add(&stats->present_delay, when - stats->pending_commit_nsec);
+		}
+	}
+	stats->pending_commit_nsec = 0;
+}
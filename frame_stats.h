@@ -0,0 +1,38 @@
+#ifndef CG_FRAME_STATS_H
+#define CG_FRAME_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CG_FRAME_STATS_BUCKETS 20
+#define CG_FRAME_STATS_WINDOW 256
+
+struct wlr_output_event_present;
+
+/* Log2 histogram over the last CG_FRAME_STATS_WINDOW samples: bucket i
+ * counts samples in [2^i, 2^(i+1)) microseconds, the first bucket also
+ * counts anything shorter and the last one anything longer. */
+struct cg_histogram {
+	uint32_t buckets[CG_FRAME_STATS_BUCKETS];
+	uint8_t ring[CG_FRAME_STATS_WINDOW]; // bucket of each sample, oldest at next once full
+	uint32_t count;
+	uint32_t next;
+};
+
+struct cg_frame_stats {
+	struct cg_histogram frame_interval;
+	struct cg_histogram commit_duration;
+	struct cg_histogram present_delay; // from the start of the commit
+	uint64_t frames;
+	uint64_t skipped; // frames with nothing to commit
+
+	uint64_t last_frame_nsec;
+	uint64_t pending_commit_nsec; // 0 if no commit awaits presentation
+};
+
+void frame_stats_frame(struct cg_frame_stats *stats, uint64_t now_nsec);
+void frame_stats_commit(struct cg_frame_stats *stats, uint64_t start_nsec, uint64_t end_nsec, bool committed);
+void frame_stats_present(struct cg_frame_stats *stats, const struct wlr_output_event_present *event);
+uint64_t frame_stats_histogram_percentile(const struct cg_histogram *histogram, uint32_t percent);
+
+#endif
@@ -1,120 +1,1429 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_output_layout.h>
+#include <wlr/types/wlr_seat.h>
 #include <wlr/util/log.h>
 
 #include "ipc.h"
+#include "log_ring.h"
 #include "server.h"
 #include "output.h"
 #include "seat.h"
+#include "shared_state.h"
+#include "snapshot.h"
+#include "view.h"
+
+#define CG_IPC_MAX_FDS 8
+/* Upper bound for a single incoming message */
+#define CG_IPC_MAX_MESSAGE_SIZE (1 << 20)
+/* Messages handed to a single sendmsg()/sendmmsg() call */
+#define CG_IPC_MAX_BATCH 64
+/* Stop reading requests from a client while that many bytes are queued
+ * for it; drop it if events keep piling up past the hard limit. */
+#define CG_IPC_HIGH_WATER_MARK (256 * 1024)
+#define CG_IPC_HARD_LIMIT (4 * CG_IPC_HIGH_WATER_MARK)
+/* Room left in SO_SNDBUF for the kernel overhead of a packet */
+#define CG_IPC_PACKET_SLACK 4096
+/* Requests handled per client and per event loop iteration; the rest waits
+ * for the next iteration, so one client cannot hold frames and input back. */
+#define CG_IPC_DISPATCH_BUDGET 32
 
-static const char GET_CURSOR_POS[] = "get_cursor_pos";
-static const char ENABLE_FORCE_REFRESH[] = "enable_force_refresh";
-static const char DISABLE_FORCE_REFRESH[] = "disable_force_refresh";
 static const char INVALID_COMMAND[] = "invalid_command";
+static const char UNAVAILABLE[] = "unavailable";
+static const char OK[] = "ok";
+
+enum cg_ipc_event_type {
+	CG_IPC_EVENT_CURSOR = 1,
+	CG_IPC_EVENT_VIEW,
+	CG_IPC_EVENT_DAMAGE,
+};
+
+enum cg_ipc_subscription {
+	CG_IPC_SUBSCRIBE_CURSOR = 1 << 0,
+	CG_IPC_SUBSCRIBE_VIEWS = 1 << 1,
+	CG_IPC_SUBSCRIBE_DAMAGE = 1 << 2,
+};
+
+/* Framing. Version 1, the default, prefixes each message with its
+ * uint16_t size, prefix included. Version 2 is selected with
+ * "set_protocol 2" (answered in the old framing) and prefixes each message
+ * with a cg_ipc_header_v2 instead: replies carry the id of the request
+ * they answer and events use id 0, so requests can be pipelined. Over
+ * SOCK_SEQPACKET, v1 messages have no prefix at all; v2 messages keep
+ * their header. */
+struct cg_ipc_header_v2 {
+	uint32_t size; // whole message, header included
+	uint32_t id;
+};
+
+/* Pushed to subscribed clients, at most once per event loop iteration.
+ * seq counts motion events, so a gap means updates were coalesced. */
+struct cg_ipc_cursor_event {
+	uint32_t event; // CG_IPC_EVENT_CURSOR
+	uint32_t seq;
+	uint32_t time_msec;
+	uint32_t reserved;
+	double x;
+	double y;
+};
+
+/* Pushed to clients subscribed to views as soon as it happens. Map, focus
+ * and title events are followed by the title, without a terminating NUL;
+ * the message size gives its length. */
+struct cg_ipc_view_event {
+	uint32_t event; // CG_IPC_EVENT_VIEW
+	uint32_t type; // cg_ipc_view_event_type
+	uint32_t view; // cg_view::id
+	uint32_t primary;
+	uint64_t time_nsec; // CLOCK_MONOTONIC
+};
+
+/* Pushed to clients subscribed to damage for each commit carrying a
+ * buffer, followed by rect_count cg_ipc_damage_rect in buffer coordinates.
+ * Past CG_IPC_MAX_DAMAGE_RECTS, the damage is sent as its bounding box. */
+struct cg_ipc_damage_event {
+	uint32_t event; // CG_IPC_EVENT_DAMAGE
+	uint32_t commit_seq; // wlr_output::commit_seq
+	uint32_t width, height; // buffer size
+	uint32_t rect_count;
+	uint32_t reserved;
+	char output[32]; // NUL-terminated, possibly truncated
+};
+
+struct cg_ipc_damage_rect {
+	int32_t x, y, width, height;
+};
+
+#define CG_IPC_MAX_DAMAGE_RECTS 256
+
+/* Reply to map_state, sent along with the memfd of the shared state page. */
+struct cg_ipc_map_state_reply {
+	uint32_t version;
+	uint32_t size;
+};
+
+/* Reply to wait_present, mirroring wlr_output_event_present. If presented
+ * is 0 the frame was discarded and the other fields are meaningless. */
+struct cg_ipc_present_reply {
+	uint64_t time_nsec; // CLOCK_MONOTONIC
+	uint64_t seq;
+	uint32_t refresh_nsec; // 0 if unknown
+	uint32_t flags; // wp_presentation_feedback_kind
+	uint32_t presented;
+	uint32_t reserved;
+};
+
+/* Reply to get_frame_stats; see cg_histogram for the bucket layout. */
+struct cg_ipc_frame_stats_reply {
+	uint32_t bucket_count; // CG_FRAME_STATS_BUCKETS
+	uint32_t window; // CG_FRAME_STATS_WINDOW
+	uint64_t frames;
+	uint64_t skipped;
+	uint32_t frame_interval[CG_FRAME_STATS_BUCKETS];
+	uint32_t commit_duration[CG_FRAME_STATS_BUCKETS];
+	uint32_t present_delay[CG_FRAME_STATS_BUCKETS];
+};
+
+/* Reply to get_ipc_stats. Counters are cumulative since startup. */
+struct cg_ipc_stats_reply {
+	uint32_t clients;
+	uint32_t deferred_clients; // clients with requests left for a later iteration
+	uint64_t requests;
+	uint64_t deferred; // times a client ran out of budget
+	uint64_t dropped_clients; // clients dropped past CG_IPC_HARD_LIMIT
+	uint64_t queued_bytes; // replies and events not written yet
+};
+
+/* Reply to get_state: this header, then output_count cg_ipc_state_output
+ * and view_count cg_ipc_state_view. Coordinates are layout coordinates. */
+struct cg_ipc_state_reply {
+	uint32_t flags; // cg_ipc_state_flags
+	uint32_t output_count;
+	uint32_t view_count;
+	uint32_t focused_view; // cg_view::id, 0 if none
+	double cursor_x, cursor_y;
+	uint32_t capabilities; // wl_seat_capability
+	uint32_t keyboards;
+	uint32_t pointers;
+	uint32_t touch;
+	uint32_t buttons_pressed;
+	uint32_t reserved;
+};
+
+enum cg_ipc_state_flags {
+	CG_IPC_STATE_LOCKSTEP = 1 << 0,
+	CG_IPC_STATE_NESTED = 1 << 1,
+	CG_IPC_STATE_CLIPBOARD_SYNC = 1 << 2, // clipboard synced with the host
+};
+
+struct cg_ipc_state_output {
+	char name[32]; // NUL-terminated, possibly truncated
+	int32_t x, y, width, height; // layout box, empty if not in the layout
+	int32_t mode_width, mode_height;
+	int32_t refresh_mhz; // 0 if unknown
+	int32_t force_refresh_hz; // -1 for the mode refresh rate, 0 if disabled
+	float scale;
+	uint32_t enabled;
+};
+
+struct cg_ipc_state_view {
+	uint32_t id;
+	uint32_t type; // cg_view_type
+	int32_t x, y, width, height;
+	uint32_t primary;
+	uint32_t focused;
+};
+
+/* Reply to snapshot, sent along with a sealed memfd holding the pixels. */
+struct cg_ipc_snapshot_reply {
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format; // DRM fourcc
+};
+
+/* Reply to render_frame, sent once the frame is committed. committed is 0
+ * if there was nothing new to show and the output was left untouched. */
+struct cg_ipc_render_frame_reply {
+	uint64_t time_nsec; // CLOCK_MONOTONIC, when frame_done was sent
+	uint32_t committed;
+	uint32_t reserved;
+};
+
+struct cg_ipc {
+	struct cg_server *server;
+	int fd;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	struct wl_event_source *event_source;
+	/* With SOCK_SEQPACKET the kernel keeps message boundaries, so
+	 * messages are not prefixed by their size. */
+	bool seqpacket;
+	struct wl_list clients; // cg_ipc_client::link
+	uint32_t subscriptions; // union of all clients subscriptions
+
+	struct wl_event_source *cursor_idle;
+	uint32_t cursor_seq;
+	uint32_t cursor_time_msec;
+	double cursor_x, cursor_y; // last position pushed to clients
+
+	struct wl_list frame_waiters; // cg_ipc_waiter::link, in request order
+	struct wl_list present_waiters; // cg_ipc_waiter::link
+
+	/* Idle sources run until none is left, so a client that stays busy
+	 * would never yield. Deferred clients are instead resumed from an
+	 * eventfd that stays readable while the list is not empty. */
+	int dispatch_fd;
+	struct wl_event_source *dispatch_source;
+	struct wl_list deferred_clients; // cg_ipc_client::deferred_link
+
+	uint64_t requests;
+	uint64_t deferred;
+	uint64_t dropped_clients;
+};
+
+/* A request answered later, from an output event. */
+struct cg_ipc_waiter {
+	struct wl_list link;
+	struct cg_ipc_client *client;
+	struct cg_output *output;
+	uint32_t id;
+};
+
+struct cg_ipc_message {
+	char *data; // framing included
+	size_t size;
+	int fd; // passed along with the message, -1 if none
+};
 
 struct cg_ipc_client {
 	struct cg_server *server;
+	struct wl_list link; // cg_ipc::clients
 	int fd;
+	int version;
+	uint32_t subscriptions;
+	/* Set instead of destroying the client from deep inside a handler;
+	 * the flush idle callback does the actual destruction. */
+	bool closing;
 
-	char *write_buffer;
-	size_t write_buffer_cap;
-	size_t write_buffer_size;
+	/* Messages out[out_head..out_count) are pending, and the first
+	 * out_sent bytes of out[out_head] are already written. */
+	struct cg_ipc_message *out;
+	size_t out_head, out_count, out_cap;
+	size_t out_sent;
+	size_t out_bytes;
+	bool write_blocked; // the last flush hit EAGAIN
 
 	char *read_buffer;
 	size_t read_buffer_cap;
 	size_t read_buffer_size;
+	/* Complete requests are left in read_buffer past the dispatch budget;
+	 * reads are paused until they are handled. */
+	bool deferred;
+	struct wl_list deferred_link; // cg_ipc::deferred_clients
+
+	struct wl_event_source *event_source;
+	uint32_t event_mask;
+	struct wl_event_source *flush_idle;
+};
+
+typedef void (*cg_ipc_command_handler)(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size);
 
-	struct wl_event_source *read_event_source;
-	struct wl_event_source *write_event_source;
+struct cg_ipc_command {
+	const char *name;
+	cg_ipc_command_handler handler;
 };
 
+static void ipc_client_handle_flush(void *data);
+
+static void ipc_update_subscriptions(struct cg_ipc *ipc) {
+	struct cg_ipc_client *client;
+	ipc->subscriptions = 0;
+	wl_list_for_each(client, &ipc->clients, link) {
+		ipc->subscriptions |= client->subscriptions;
+	}
+}
+
+static void ipc_client_free_messages(struct cg_ipc_client *client, size_t count) {
+	for(size_t i = 0; i < count; i++) {
+		struct cg_ipc_message *msg = &client->out[client->out_head];
+		if(msg->fd != -1) {
+			close(msg->fd);
+		}
+		client->out_bytes -= msg->size;
+		free(msg->data);
+		client->out_head++;
+	}
+	client->out_sent = 0;
+	if(client->out_head == client->out_count) {
+		client->out_head = client->out_count = 0;
+	}
+}
+
+/* Frame waiters each account for one of output->frame_requests, which
+ * must not outlive them. */
+static void ipc_remove_waiters(struct wl_list *waiters, struct cg_ipc_client *client, bool frame) {
+	struct cg_ipc_waiter *waiter, *tmp;
+	wl_list_for_each_safe(waiter, tmp, waiters, link) {
+		if(waiter->client == client) {
+			if(frame && waiter->output->frame_requests > 0) {
+				waiter->output->frame_requests--;
+			}
+			wl_list_remove(&waiter->link);
+			free(waiter);
+		}
+	}
+}
+
 static void ipc_client_destroy(struct cg_ipc_client *client) {
-	close(client->fd);
-	wl_event_source_remove(client->read_event_source);
-	if(client->write_event_source != NULL) {
-		wl_event_source_remove(client->write_event_source);
+	ipc_remove_waiters(&client->server->ipc->frame_waiters, client, true);
+	ipc_remove_waiters(&client->server->ipc->present_waiters, client, false);
+	wl_list_remove(&client->link);
+	if(client->deferred) {
+		wl_list_remove(&client->deferred_link);
+	}
+	ipc_update_subscriptions(client->server->ipc);
+	wl_event_source_remove(client->event_source);
+	if(client->flush_idle != NULL) {
+		wl_event_source_remove(client->flush_idle);
 	}
-	free(client->write_buffer);
+	ipc_client_free_messages(client, client->out_count - client->out_head);
+	close(client->fd);
+	free(client->out);
 	free(client->read_buffer);
 	free(client);
 }
 
-static int ipc_handle_write(int fd, uint32_t mask, void *data) {
-	struct cg_ipc_client *client = data;
+static void ipc_client_close(struct cg_ipc_client *client) {
+	client->closing = true;
+	if(client->flush_idle == NULL) {
+		client->flush_idle = wl_event_loop_add_idle(wl_display_get_event_loop(client->server->wl_display),
+			ipc_client_handle_flush, client);
+	}
+}
 
-	if(mask & WL_EVENT_ERROR) {
-		wlr_log(WLR_ERROR, "IPC client error");
-		ipc_client_destroy(client);
-		return 0;
+/* Reads are paused above the high-water mark and while requests are
+ * deferred, writes are polled only while the socket is full. */
+static void ipc_client_update_mask(struct cg_ipc_client *client) {
+	uint32_t mask = 0;
+	if(!client->closing && !client->deferred && client->out_bytes < CG_IPC_HIGH_WATER_MARK) {
+		mask |= WL_EVENT_READABLE;
+	}
+	if(client->write_blocked && client->out_head < client->out_count) {
+		mask |= WL_EVENT_WRITABLE;
 	}
+	if(mask != client->event_mask) {
+		wl_event_source_fd_update(client->event_source, mask);
+		client->event_mask = mask;
+	}
+}
 
-	if(mask & WL_EVENT_HANGUP) {
-		ipc_client_destroy(client);
-		return 0;
+static void ipc_set_fds(struct msghdr *msg, void *control, const int *fds, size_t fd_count) {
+	if(fd_count == 0) {
+		return;
+	}
+	msg->msg_control = control;
+	msg->msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+}
+
+/* Writes as many queued messages as possible with one sendmsg() per batch.
+ * Returns false on a fatal socket error. */
+static bool ipc_client_flush_stream(struct cg_ipc_client *client) {
+	while(client->out_head < client->out_count) {
+		struct iovec iov[CG_IPC_MAX_BATCH];
+		int fds[CG_IPC_MAX_FDS];
+		size_t count = 0, fd_count = 0, total = 0;
+		for(size_t i = client->out_head; i < client->out_count && count < CG_IPC_MAX_BATCH; i++) {
+			struct cg_ipc_message *msg = &client->out[i];
+			if(msg->fd != -1) {
+				if(fd_count == CG_IPC_MAX_FDS) {
+					break;
+				}
+				fds[fd_count++] = msg->fd;
+			}
+			iov[count].iov_base = msg->data;
+			iov[count].iov_len = msg->size;
+			total += msg->size;
+			count++;
+		}
+		iov[0].iov_base = (char*)iov[0].iov_base + client->out_sent;
+		iov[0].iov_len -= client->out_sent;
+		total -= client->out_sent;
+
+		union {
+			char buf[CMSG_SPACE(sizeof(int) * CG_IPC_MAX_FDS)];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = count,
+		};
+		ipc_set_fds(&msg, &control, fds, fd_count);
+
+		ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+		if(sent == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				client->write_blocked = true;
+				return true;
+			}
+			return false;
+		}
+
+		/* The fds went out with the first byte of this batch, which is never
+		 * later than the message they belong to. */
+		for(size_t i = client->out_head; i < client->out_head + count; i++) {
+			if(client->out[i].fd != -1) {
+				close(client->out[i].fd);
+				client->out[i].fd = -1;
+			}
+		}
+
+		size_t remaining = sent;
+		while(remaining > 0) {
+			size_t left = client->out[client->out_head].size - client->out_sent;
+			if(remaining < left) {
+				client->out_sent += remaining;
+				break;
+			}
+			remaining -= left;
+			ipc_client_free_messages(client, 1);
+		}
+
+		if((size_t)sent < total) {
+			client->write_blocked = true;
+			return true;
+		}
 	}
+	client->write_blocked = false;
+	return true;
+}
 
-	ssize_t size = send(client->fd, client->write_buffer, client->write_buffer_size, 0);
-	if(size == -1) {
+/* Same as above, with one packet per message and a single sendmmsg() per
+ * batch. */
+static bool ipc_client_flush_packets(struct cg_ipc_client *client) {
+	while(client->out_head < client->out_count) {
+		struct mmsghdr msgs[CG_IPC_MAX_BATCH];
+		struct iovec iov[CG_IPC_MAX_BATCH];
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control[CG_IPC_MAX_BATCH];
+
+		size_t count = client->out_count - client->out_head;
+		if(count > CG_IPC_MAX_BATCH) {
+			count = CG_IPC_MAX_BATCH;
+		}
+		memset(msgs, 0, sizeof(struct mmsghdr) * count);
+		for(size_t i = 0; i < count; i++) {
+			struct cg_ipc_message *msg = &client->out[client->out_head + i];
+			iov[i].iov_base = msg->data;
+			iov[i].iov_len = msg->size;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			if(msg->fd != -1) {
+				ipc_set_fds(&msgs[i].msg_hdr, &control[i], &msg->fd, 1);
+			}
+		}
+
+		int sent = sendmmsg(client->fd, msgs, count, MSG_NOSIGNAL);
+		if(sent == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				client->write_blocked = true;
+				return true;
+			}
+			return false;
+		}
+
+		ipc_client_free_messages(client, sent);
+		if((size_t)sent < count) {
+			client->write_blocked = true;
+			return true;
+		}
+	}
+	client->write_blocked = false;
+	return true;
+}
+
+static void ipc_client_flush(struct cg_ipc_client *client) {
+	bool ok = client->server->ipc->seqpacket ?
+		ipc_client_flush_packets(client) : ipc_client_flush_stream(client);
+	if(!ok) {
 		wlr_log(WLR_ERROR, "IPC write error");
+		ipc_client_close(client);
+	}
+	ipc_client_update_mask(client);
+}
+
+/* All the writes queued during an event loop iteration go out together. */
+static void ipc_client_handle_flush(void *data) {
+	struct cg_ipc_client *client = data;
+	client->flush_idle = NULL;
+
+	if(client->closing) {
 		ipc_client_destroy(client);
-		return 0;
+		return;
+	}
+	if(!client->write_blocked) {
+		ipc_client_flush(client);
+	}
+}
+
+static void ipc_client_queue(struct cg_ipc_client *client, uint32_t id, const void *payload, size_t size, int fd) {
+	if(client->closing) {
+		if(fd != -1) {
+			close(fd);
+		}
+		return;
 	}
 
-	memmove(client->write_buffer, client->write_buffer + size, client->write_buffer_size - size);
-	client->write_buffer_size -= size;
-	if(client->write_buffer_size == 0 && client->write_event_source) {
-		wl_event_source_remove(client->write_event_source);
-		client->write_event_source = NULL;
-	} else if(client->write_buffer_size > 0 && client->write_event_source == NULL) {
-		client->write_event_source = wl_event_loop_add_fd(wl_display_get_event_loop(client->server->wl_display),
-			client->fd, WL_EVENT_WRITABLE, ipc_handle_write, client);
+	if(client->out_count == client->out_cap) {
+		if(client->out_head > 0) {
+			memmove(client->out, client->out + client->out_head,
+				sizeof(struct cg_ipc_message) * (client->out_count - client->out_head));
+			client->out_count -= client->out_head;
+			client->out_head = 0;
+		} else {
+			size_t cap = client->out_cap ? client->out_cap * 2 : 16;
+			struct cg_ipc_message *out = realloc(client->out, sizeof(struct cg_ipc_message) * cap);
+			if(out == NULL) {
+				wlr_log(WLR_ERROR, "realloc() failed");
+				goto error;
+			}
+			client->out = out;
+			client->out_cap = cap;
+		}
 	}
 
-	return 0;
+	size_t header_size;
+	if(client->version >= 2) {
+		header_size = sizeof(struct cg_ipc_header_v2);
+	} else {
+		header_size = client->server->ipc->seqpacket ? 0 : sizeof(uint16_t);
+		if(header_size > 0 && size + header_size > UINT16_MAX) {
+			wlr_log(WLR_ERROR, "IPC message too large for protocol version 1");
+			goto error;
+		}
+	}
+
+	char *data = malloc(header_size + size);
+	if(data == NULL) {
+		wlr_log(WLR_ERROR, "malloc() failed");
+		goto error;
+	}
+	if(client->version >= 2) {
+		struct cg_ipc_header_v2 header = {
+			.size = header_size + size,
+			.id = id,
+		};
+		memcpy(data, &header, sizeof(header));
+	} else if(header_size > 0) {
+		uint16_t full_size = header_size + size;
+		memcpy(data, &full_size, sizeof(uint16_t));
+	}
+	memcpy(data + header_size, payload, size);
+
+	client->out[client->out_count++] = (struct cg_ipc_message){
+		.data = data,
+		.size = header_size + size,
+		.fd = fd,
+	};
+	client->out_bytes += header_size + size;
+
+	if(client->out_bytes > CG_IPC_HARD_LIMIT) {
+		wlr_log(WLR_ERROR, "IPC client is not reading, dropping it");
+		client->server->ipc->dropped_clients++;
+		ipc_client_close(client);
+		return;
+	}
+	if(client->flush_idle == NULL && !client->write_blocked) {
+		client->flush_idle = wl_event_loop_add_idle(wl_display_get_event_loop(client->server->wl_display),
+			ipc_client_handle_flush, client);
+	}
+	ipc_client_update_mask(client);
+	return;
+
+error:
+	if(fd != -1) {
+		close(fd);
+	}
+	ipc_client_close(client);
 }
 
-static void ipc_client_write(struct cg_ipc_client *client, const char *message, uint16_t size) {
-	uint16_t full_size = size + sizeof(uint16_t);
+static void ipc_client_reply(struct cg_ipc_client *client, uint32_t id, const void *message, size_t size) {
+	ipc_client_queue(client, id, message, size, -1);
+}
 
-	if(client->write_buffer_size + full_size > client->write_buffer_cap) {
-		wlr_log(WLR_ERROR, "IPC client write overflow");
-		ipc_client_destroy(client);
+static void ipc_client_reply_fd(struct cg_ipc_client *client, uint32_t id, const void *message, size_t size, int fd) {
+	int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if(dup_fd == -1) {
+		wlr_log(WLR_ERROR, "IPC: failed to dup fd");
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	ipc_client_queue(client, id, message, size, dup_fd);
+}
+
+static void ipc_command_get_cursor_pos(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	uint32_t x = client->server->seat->cursor->x;
+	uint32_t y = client->server->seat->cursor->y;
+	uint32_t pos[2] = {x, y};
+	ipc_client_reply(client, id, pos, sizeof(pos));
+}
+
+/* Commands of the original protocol did not reply; v1 clients do not
+ * expect them to. */
+static void ipc_client_reply_ok_v2(struct cg_ipc_client *client, uint32_t id) {
+	if(client->version >= 2) {
+		ipc_client_reply(client, id, OK, sizeof(OK)-1);
+	}
+}
+
+/* Outputs that already have a rate keep it; the others, and those added
+ * later, get the one of the -r rules. */
+static void ipc_command_enable_force_refresh(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_output *output;
+	client->server->force_refresh_override = true;
+	client->server->force_refresh = true;
+	wl_list_for_each (output, &client->server->outputs, link) {
+		output_set_force_refresh(output, output->force_refresh_hz ? output->force_refresh_hz : output_default_refresh(output));
+	}
+	ipc_client_reply_ok_v2(client, id);
+}
+
+static void ipc_command_disable_force_refresh(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_output *output;
+	client->server->force_refresh_override = true;
+	client->server->force_refresh = false;
+	wl_list_for_each (output, &client->server->outputs, link) {
+		output_set_force_refresh(output, 0);
+	}
+	ipc_client_reply_ok_v2(client, id);
+}
+
+static void ipc_command_subscribe_cursor(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_ipc *ipc = client->server->ipc;
+	client->subscriptions |= CG_IPC_SUBSCRIBE_CURSOR;
+	ipc_update_subscriptions(ipc);
+
+	/* Start the stream with the current position. */
+	struct cg_ipc_cursor_event event = {
+		.event = CG_IPC_EVENT_CURSOR,
+		.seq = ipc->cursor_seq,
+		.time_msec = ipc->cursor_time_msec,
+		.x = client->server->seat->cursor->x,
+		.y = client->server->seat->cursor->y,
+	};
+	ipc_client_reply(client, id, &event, sizeof(event));
+}
+
+static void ipc_command_unsubscribe_cursor(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	client->subscriptions &= ~CG_IPC_SUBSCRIBE_CURSOR;
+	ipc_update_subscriptions(client->server->ipc);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+/* Builds a view event; the caller frees it. */
+static char *ipc_view_event(struct cg_view *view, enum cg_ipc_view_event_type type, size_t *size) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct cg_ipc_view_event event = {
+		.event = CG_IPC_EVENT_VIEW,
+		.type = type,
+		.view = view->id,
+		.primary = view_is_primary(view),
+		.time_nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+	};
+
+	char *title = type != CG_IPC_VIEW_UNMAP ? view_get_title(view) : NULL;
+	size_t title_size = title ? strlen(title) : 0;
+	/* Keep the whole event within a v1 message. */
+	if(title_size > UINT16_MAX - sizeof(uint16_t) - sizeof(event)) {
+		title_size = UINT16_MAX - sizeof(uint16_t) - sizeof(event);
+	}
+
+	*size = sizeof(event) + title_size;
+	char *message = malloc(*size);
+	if(message != NULL) {
+		memcpy(message, &event, sizeof(event));
+		memcpy(message + sizeof(event), title, title_size);
+	}
+	free(title);
+	return message;
+}
+
+static void ipc_command_subscribe_views(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_server *server = client->server;
+	client->subscriptions |= CG_IPC_SUBSCRIBE_VIEWS;
+	ipc_update_subscriptions(server->ipc);
+
+	/* Start the stream with the views already mapped, oldest first, and
+	 * the focused one. */
+	struct cg_view *view;
+	size_t size;
+	wl_list_for_each_reverse(view, &server->views, link) {
+		char *message = ipc_view_event(view, CG_IPC_VIEW_MAP, &size);
+		if(message != NULL) {
+			ipc_client_reply(client, id, message, size);
+			free(message);
+		}
+	}
+	view = seat_get_focus(server->seat);
+	if(view != NULL) {
+		char *message = ipc_view_event(view, CG_IPC_VIEW_FOCUS, &size);
+		if(message != NULL) {
+			ipc_client_reply(client, id, message, size);
+			free(message);
+		}
+	}
+}
+
+static void ipc_command_unsubscribe_views(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	client->subscriptions &= ~CG_IPC_SUBSCRIBE_VIEWS;
+	ipc_update_subscriptions(client->server->ipc);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+static void ipc_command_subscribe_damage(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	client->subscriptions |= CG_IPC_SUBSCRIBE_DAMAGE;
+	ipc_update_subscriptions(client->server->ipc);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+static void ipc_command_unsubscribe_damage(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	client->subscriptions &= ~CG_IPC_SUBSCRIBE_DAMAGE;
+	ipc_update_subscriptions(client->server->ipc);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+static void ipc_command_map_state(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	int fd = shared_state_get_fd(client->server);
+	if(fd == -1) {
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	struct cg_ipc_map_state_reply reply = {
+		.version = CG_SHARED_STATE_VERSION,
+		.size = sizeof(struct cg_shared_state_page),
+	};
+	ipc_client_reply_fd(client, id, &reply, sizeof(reply), fd);
+}
+
+/* Arguments are binary-safe, but textual ones may come with a trailing
+ * newline or NULs from clients written for the old parser. */
+static size_t ipc_args_length(const char *args, size_t args_size) {
+	while(args_size > 0 && (args[args_size - 1] == '\0' || args[args_size - 1] == '\n')) {
+		args_size--;
+	}
+	return args_size;
+}
+
+/* Copies args into a NUL-terminated buffer, returns false if they do not fit. */
+static bool ipc_args_to_string(char *buf, size_t buf_size, const char *args, size_t args_size) {
+	args_size = ipc_args_length(args, args_size);
+	if(args_size >= buf_size || memchr(args, '\0', args_size) != NULL) {
+		return false;
+	}
+	memcpy(buf, args, args_size);
+	buf[args_size] = '\0';
+	return true;
+}
+
+/* The output named in args, or the most recently added one if args are
+ * empty. */
+static struct cg_output *ipc_args_to_output(struct cg_server *server, const char *args, size_t args_size) {
+	if(ipc_args_length(args, args_size) == 0) {
+		if(wl_list_empty(&server->outputs)) {
+			return NULL;
+		}
+		struct cg_output *output = wl_container_of(server->outputs.next, output, link);
+		return output;
+	}
+
+	char name[64];
+	if(!ipc_args_to_string(name, sizeof(name), args, args_size)) {
+		return NULL;
+	}
+	return output_from_name(server, name);
+}
+
+/* Splits "<output> <value>", the value being copied to value. */
+static struct cg_output *ipc_args_to_output_value(struct cg_server *server, const char *args, size_t args_size,
+		char *value, size_t value_size) {
+	const char *sep = memchr(args, ' ', args_size);
+	if(sep == NULL || sep == args ||
+			!ipc_args_to_string(value, value_size, sep + 1, args + args_size - sep - 1)) {
+		return NULL;
+	}
+	return ipc_args_to_output(server, args, sep - args);
+}
+
+static bool ipc_client_add_waiter(struct cg_ipc_client *client, uint32_t id, struct wl_list *waiters, struct cg_output *output) {
+	struct cg_ipc_waiter *waiter = calloc(1, sizeof(struct cg_ipc_waiter));
+	if(waiter == NULL) {
+		wlr_log(WLR_ERROR, "calloc() failed");
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return false;
+	}
+	waiter->client = client;
+	waiter->output = output;
+	waiter->id = id;
+	wl_list_insert(waiters->prev, &waiter->link);
+	return true;
+}
+
+static void ipc_command_render_frame(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_output *output = ipc_args_to_output(client->server, args, args_size);
+	if(output == NULL) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+	/* Nothing would ever render the frame. */
+	if(!output->wlr_output->enabled) {
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	if(ipc_client_add_waiter(client, id, &client->server->ipc->frame_waiters, output)) {
+		output_request_frame(output);
+	}
+}
+
+static void ipc_command_enable_lockstep(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	output_set_lockstep(client->server, true);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+static void ipc_command_disable_lockstep(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	output_set_lockstep(client->server, false);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+/* set_force_refresh <output> <hz|auto|0> */
+static void ipc_command_set_force_refresh(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	char value[16];
+	int hz;
+	struct cg_output *output = ipc_args_to_output_value(client->server, args, args_size, value, sizeof(value));
+	if(output == NULL || !output_parse_refresh(value, &hz)) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+	output_set_force_refresh(output, hz);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+/* set_max_fps <output> <fps|0> */
+static void ipc_command_set_max_fps(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	char value[16];
+	int fps;
+	struct cg_output *output = ipc_args_to_output_value(client->server, args, args_size, value, sizeof(value));
+	if(output == NULL || !output_parse_refresh(value, &fps) || fps == FORCED_REFRESH_AUTO) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+	output_set_max_fps(output, fps);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+/* set_max_render_time <output> <ms|auto|0> */
+static void ipc_command_set_max_render_time(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	char value[16];
+	int ms;
+	struct cg_output *output = ipc_args_to_output_value(client->server, args, args_size, value, sizeof(value));
+	if(output == NULL || !output_parse_delay(value, &ms)) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+	output_set_max_render_time(output, ms);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+/* set_frame_done_delay <output> <ms|auto|0> */
+static void ipc_command_set_frame_done_delay(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	char value[16];
+	int ms;
+	struct cg_output *output = ipc_args_to_output_value(client->server, args, args_size, value, sizeof(value));
+	if(output == NULL || !output_parse_delay(value, &ms)) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+	output_set_frame_done_delay(output, ms);
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+/* inject_input <packed cg_input_event array> */
+static void ipc_command_inject_input(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	if(args_size == 0 || args_size % sizeof(struct cg_input_event) != 0) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+
+	/* The payload sits at an arbitrary offset of the read buffer. */
+	struct cg_input_event *events = malloc(args_size);
+	if(events == NULL) {
+		wlr_log(WLR_ERROR, "malloc() failed");
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	memcpy(events, args, args_size);
+	seat_inject_input(client->server->seat, events, args_size / sizeof(struct cg_input_event));
+	free(events);
+
+	ipc_client_reply(client, id, OK, sizeof(OK)-1);
+}
+
+static void ipc_command_wait_present(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_output *output = ipc_args_to_output(client->server, args, args_size);
+	if(output == NULL) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+	/* Nothing would ever be presented. */
+	if(!output->wlr_output->enabled) {
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	if(ipc_client_add_waiter(client, id, &client->server->ipc->present_waiters, output)) {
+		wlr_output_schedule_frame(output->wlr_output);
+	}
+}
+
+static void ipc_command_get_frame_stats(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_output *output = ipc_args_to_output(client->server, args, args_size);
+	if(output == NULL) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+
+	const struct cg_frame_stats *stats = &output->frame_stats;
+	struct cg_ipc_frame_stats_reply reply = {
+		.bucket_count = CG_FRAME_STATS_BUCKETS,
+		.window = CG_FRAME_STATS_WINDOW,
+		.frames = stats->frames,
+		.skipped = stats->skipped,
+	};
+	memcpy(reply.frame_interval, stats->frame_interval.buckets, sizeof(reply.frame_interval));
+	memcpy(reply.commit_duration, stats->commit_duration.buckets, sizeof(reply.commit_duration));
+	memcpy(reply.present_delay, stats->present_delay.buckets, sizeof(reply.present_delay));
+	ipc_client_reply(client, id, &reply, sizeof(reply));
+}
+
+static void ipc_command_get_ipc_stats(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_ipc *ipc = client->server->ipc;
+	struct cg_ipc_stats_reply reply = {
+		.requests = ipc->requests,
+		.deferred = ipc->deferred,
+		.dropped_clients = ipc->dropped_clients,
+	};
+	struct cg_ipc_client *other;
+	wl_list_for_each(other, &ipc->clients, link) {
+		reply.clients++;
+		reply.deferred_clients += other->deferred;
+		reply.queued_bytes += other->out_bytes;
+	}
+	ipc_client_reply(client, id, &reply, sizeof(reply));
+}
+
+static void ipc_command_get_state(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_server *server = client->server;
+	struct cg_seat *seat = server->seat;
+	struct cg_view *focus = seat_get_focus(seat);
+
+	struct cg_ipc_state_reply header = {
+		.output_count = wl_list_length(&server->outputs),
+		.view_count = wl_list_length(&server->views),
+		.focused_view = focus ? focus->id : 0,
+		.cursor_x = seat->cursor->x,
+		.cursor_y = seat->cursor->y,
+		.capabilities = seat->seat->capabilities,
+		.keyboards = wl_list_length(&seat->keyboard_groups),
+		.pointers = wl_list_length(&seat->pointers),
+		.touch = wl_list_length(&seat->touch),
+		.buttons_pressed = seat->seat->pointer_state.button_count,
+	};
+	if(server->lockstep) {
+		header.flags |= CG_IPC_STATE_LOCKSTEP;
+	}
+	if(server->wl_backend != NULL) {
+		header.flags |= CG_IPC_STATE_NESTED;
+	}
+	if(server->remote_clipboard_sync != NULL) {
+		header.flags |= CG_IPC_STATE_CLIPBOARD_SYNC;
+	}
+
+	size_t size = sizeof(header) + header.output_count * sizeof(struct cg_ipc_state_output) +
+		header.view_count * sizeof(struct cg_ipc_state_view);
+	char *reply = calloc(1, size);
+	if(reply == NULL) {
+		wlr_log(WLR_ERROR, "calloc() failed");
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
 		return;
 	}
+	memcpy(reply, &header, sizeof(header));
 
-	memcpy(client->write_buffer + client->write_buffer_size, &full_size, sizeof(uint16_t));
-	client->write_buffer_size += sizeof(uint16_t);
+	struct cg_ipc_state_output *out = (struct cg_ipc_state_output*)(reply + sizeof(header));
+	struct cg_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_output *wlr_output = output->wlr_output;
+		struct wlr_box box;
+		wlr_output_layout_get_box(server->output_layout, wlr_output, &box);
+		snprintf(out->name, sizeof(out->name), "%s", wlr_output->name);
+		out->x = box.x;
+		out->y = box.y;
+		out->width = box.width;
+		out->height = box.height;
+		out->mode_width = wlr_output->width;
+		out->mode_height = wlr_output->height;
+		out->refresh_mhz = wlr_output->refresh;
+		out->force_refresh_hz = output->force_refresh_hz;
+		out->scale = wlr_output->scale;
+		out->enabled = wlr_output->enabled;
+		out++;
+	}
 
-	memcpy(client->write_buffer + client->write_buffer_size, message, size);
-	client->write_buffer_size += size;
+	struct cg_ipc_state_view *out_view = (struct cg_ipc_state_view*)out;
+	struct cg_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		int width, height;
+		view->impl->get_geometry(view, &width, &height);
+		*out_view++ = (struct cg_ipc_state_view){
+			.id = view->id,
+			.type = view->type,
+			.x = view->lx,
+			.y = view->ly,
+			.width = width,
+			.height = height,
+			.primary = view_is_primary(view),
+			.focused = view == focus,
+		};
+	}
 
-	ipc_handle_write(client->fd, 0, client);
+	ipc_client_reply(client, id, reply, size);
+	free(reply);
 }
 
-static void ipc_client_handle_message(struct cg_ipc_client *client, char *message, size_t size) {
-	if(!strncmp(message, GET_CURSOR_POS, sizeof(GET_CURSOR_POS)-1)) {
-		uint32_t x = client->server->seat->cursor->x;
-		uint32_t y = client->server->seat->cursor->y;
-		uint32_t pos[2] = {x, y};
-		ipc_client_write(client, (char*)&pos[0], sizeof(pos));
-	} else if(!strncmp(message, ENABLE_FORCE_REFRESH, sizeof(ENABLE_FORCE_REFRESH)-1)) {
-		client->server->force_refresh = true;
-		struct cg_output *output;
-		wl_list_for_each (output, &client->server->outputs, link) {
-			wl_event_source_timer_update(output->timer, FORCED_REFRESH_DELAY);
+static void ipc_command_snapshot(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	struct cg_output *output = ipc_args_to_output(client->server, args, args_size);
+	if(output == NULL) {
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		return;
+	}
+
+	struct cg_snapshot snapshot;
+	int fd = snapshot_output(output, &snapshot);
+	if(fd == -1) {
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	struct cg_ipc_snapshot_reply reply = {
+		.width = snapshot.width,
+		.height = snapshot.height,
+		.stride = snapshot.stride,
+		.format = snapshot.format,
+	};
+	ipc_client_queue(client, id, &reply, sizeof(reply), fd);
+}
+
+/* set_log_level <silent|error|info|debug> */
+static void ipc_command_set_log_level(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	static const char *const levels[] = {
+		[WLR_SILENT] = "silent",
+		[WLR_ERROR] = "error",
+		[WLR_INFO] = "info",
+		[WLR_DEBUG] = "debug",
+	};
+	char name[16];
+	if(ipc_args_to_string(name, sizeof(name), args, args_size)) {
+		for(size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+			if(!strcmp(name, levels[i])) {
+				client->server->log_level = i;
+				log_ring_set_level(i);
+				ipc_client_reply(client, id, OK, sizeof(OK)-1);
+				return;
+			}
+		}
+	}
+	ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+}
+
+/* dump_log [count], replies with the most recent log lines as text */
+static void ipc_command_dump_log(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	size_t count = 100;
+	char count_str[16];
+	if(ipc_args_length(args, args_size) > 0) {
+		char *end;
+		if(!ipc_args_to_string(count_str, sizeof(count_str), args, args_size) ||
+				(count = strtoul(count_str, &end, 10), *end != '\0')) {
+			ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+			return;
+		}
+	}
+
+	/* Version 1 messages cannot be larger than that. */
+	size_t size = client->version >= 2 ? CG_IPC_HIGH_WATER_MARK : UINT16_MAX - sizeof(uint16_t);
+	/* A packet has to fit in the send buffer whole, with some room for the
+	 * kernel bookkeeping and the v2 header. */
+	int sndbuf;
+	socklen_t sndbuf_len = sizeof(sndbuf);
+	if(client->server->ipc->seqpacket &&
+			getsockopt(client->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_len) == 0 &&
+			(size_t)sndbuf < size + CG_IPC_PACKET_SLACK) {
+		size = sndbuf > CG_IPC_PACKET_SLACK ? (size_t)sndbuf - CG_IPC_PACKET_SLACK : 0;
+	}
+	char *text = malloc(size);
+	if(text == NULL) {
+		ipc_client_reply(client, id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+		return;
+	}
+	size_t len = log_ring_dump(text, size, count);
+	ipc_client_reply(client, id, text, len);
+	free(text);
+}
+
+/* warp_cursor <x> <y> [norel], in layout coordinates */
+static void ipc_command_warp_cursor(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	char str[64];
+	if(ipc_args_to_string(str, sizeof(str), args, args_size)) {
+		char *end;
+		double x = strtod(str, &end);
+		bool valid = end != str && *end == ' ';
+		char *y_str = end;
+		double y = valid ? strtod(y_str, &end) : 0;
+		valid = valid && end != y_str;
+		bool relative = true;
+		if(valid && !strcmp(end, " norel")) {
+			relative = false;
+		} else if(*end != '\0') {
+			valid = false;
+		}
+		if(valid && seat_warp_cursor(client->server->seat, x, y, relative)) {
+			ipc_client_reply(client, id, OK, sizeof(OK)-1);
+			return;
 		}
-	} else if(!strncmp(message, DISABLE_FORCE_REFRESH, sizeof(DISABLE_FORCE_REFRESH)-1)) {
-		client->server->force_refresh = false;
+	}
+	ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+}
+
+static void ipc_command_set_protocol(struct cg_ipc_client *client, uint32_t id, const char *args, size_t args_size) {
+	if(ipc_args_length(args, args_size) == 1 && (args[0] == '1' || args[0] == '2')) {
+		ipc_client_reply(client, id, OK, sizeof(OK)-1);
+		client->version = args[0] - '0';
 	} else {
-		wlr_log(WLR_ERROR, "IPC invalid command");
-		ipc_client_write(client, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+		ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+	}
+}
+
+static const struct cg_ipc_command ipc_commands[] = {
+	{ "get_cursor_pos", ipc_command_get_cursor_pos },
+	{ "enable_force_refresh", ipc_command_enable_force_refresh },
+	{ "disable_force_refresh", ipc_command_disable_force_refresh },
+	{ "subscribe_cursor", ipc_command_subscribe_cursor },
+	{ "unsubscribe_cursor", ipc_command_unsubscribe_cursor },
+	{ "map_state", ipc_command_map_state },
+	{ "subscribe_views", ipc_command_subscribe_views },
+	{ "unsubscribe_views", ipc_command_unsubscribe_views },
+	{ "subscribe_damage", ipc_command_subscribe_damage },
+	{ "unsubscribe_damage", ipc_command_unsubscribe_damage },
+	{ "set_protocol", ipc_command_set_protocol },
+	{ "render_frame", ipc_command_render_frame },
+	{ "enable_lockstep", ipc_command_enable_lockstep },
+	{ "disable_lockstep", ipc_command_disable_lockstep },
+	{ "set_force_refresh", ipc_command_set_force_refresh },
+	{ "set_max_fps", ipc_command_set_max_fps },
+	{ "set_max_render_time", ipc_command_set_max_render_time },
+	{ "set_frame_done_delay", ipc_command_set_frame_done_delay },
+	{ "inject_input", ipc_command_inject_input },
+	{ "snapshot", ipc_command_snapshot },
+	{ "wait_present", ipc_command_wait_present },
+	{ "get_frame_stats", ipc_command_get_frame_stats },
+	{ "set_log_level", ipc_command_set_log_level },
+	{ "dump_log", ipc_command_dump_log },
+	{ "warp_cursor", ipc_command_warp_cursor },
+	{ "get_ipc_stats", ipc_command_get_ipc_stats },
+	{ "get_state", ipc_command_get_state },
+};
+
+/* A command is its name, optionally followed by a space and arguments.
+ * The old parser matched names by prefix, so the name also ends at a
+ * newline or a NUL, which its clients may have sent. */
+static void ipc_client_handle_message(struct cg_ipc_client *client, uint32_t id, const char *message, size_t size) {
+	client->server->ipc->requests++;
+	size_t name_size = 0;
+	while(name_size < size && message[name_size] != ' ' && message[name_size] != '\0' && message[name_size] != '\n') {
+		name_size++;
+	}
+	const char *args = message + name_size;
+	size_t args_size = size - name_size;
+	if(args_size > 0 && args[0] == ' ') {
+		args++;
+		args_size--;
+	}
+	for(size_t i = 0; i < sizeof(ipc_commands) / sizeof(ipc_commands[0]); i++) {
+		const struct cg_ipc_command *command = &ipc_commands[i];
+		if(strlen(command->name) == name_size && !memcmp(command->name, message, name_size)) {
+			command->handler(client, id, args, args_size);
+			return;
+		}
+	}
+
+	wlr_log(WLR_DEBUG, "IPC invalid command");
+	ipc_client_reply(client, id, INVALID_COMMAND, sizeof(INVALID_COMMAND)-1);
+}
+
+/* Parses the framing at the start of data. Returns false if it is invalid;
+ * otherwise *msg_size is the size of the whole message, or 0 if even the
+ * header is not complete yet. */
+static bool ipc_client_parse_header(struct cg_ipc_client *client, const char *data, size_t size,
+		size_t *msg_size, size_t *header_size, uint32_t *id) {
+	*msg_size = 0;
+	*id = 0;
+	if(client->version >= 2) {
+		struct cg_ipc_header_v2 header;
+		*header_size = sizeof(header);
+		if(size < sizeof(header)) {
+			return true;
+		}
+		memcpy(&header, data, sizeof(header));
+		if(header.size < sizeof(header) || header.size > CG_IPC_MAX_MESSAGE_SIZE) {
+			return false;
+		}
+		*msg_size = header.size;
+		*id = header.id;
+	} else {
+		uint16_t full_size;
+		*header_size = sizeof(uint16_t);
+		if(size < sizeof(uint16_t)) {
+			return true;
+		}
+		memcpy(&full_size, data, sizeof(uint16_t));
+		if(full_size < sizeof(uint16_t)) {
+			return false;
+		}
+		*msg_size = full_size;
+	}
+	return true;
+}
+
+static bool ipc_client_reserve_read(struct cg_ipc_client *client, size_t size) {
+	if(size <= client->read_buffer_cap) {
+		return true;
+	}
+	char *read_buffer = realloc(client->read_buffer, size);
+	if(read_buffer == NULL) {
+		wlr_log(WLR_ERROR, "realloc() failed");
+		return false;
+	}
+	client->read_buffer = read_buffer;
+	client->read_buffer_cap = size;
+	return true;
+}
+
+static void ipc_client_read_packet(struct cg_ipc_client *client) {
+	/* Peek at the packet size first so messages are not limited by
+	 * the initial buffer size, then read it in place. */
+	ssize_t sz = recv(client->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if(sz > CG_IPC_MAX_MESSAGE_SIZE) {
+		wlr_log(WLR_ERROR, "IPC message too large");
+		ipc_client_close(client);
+		return;
+	}
+	if(sz > 0 && !ipc_client_reserve_read(client, sz)) {
+		ipc_client_close(client);
+		return;
+	}
+
+	if(sz >= 0) {
+		sz = recv(client->fd, client->read_buffer, client->read_buffer_cap, 0);
+	}
+	if(sz == -1) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			wlr_log(WLR_ERROR, "Failed to read from client");
+			ipc_client_close(client);
+		}
+		return;
+	}
+	if(sz == 0) {
+		ipc_client_close(client);
+		return;
+	}
+
+	if(client->version < 2) {
+		ipc_client_handle_message(client, 0, client->read_buffer, sz);
+		return;
+	}
+
+	size_t msg_size, header_size;
+	uint32_t id;
+	if(!ipc_client_parse_header(client, client->read_buffer, sz, &msg_size, &header_size, &id) ||
+			msg_size != (size_t)sz) {
+		wlr_log(WLR_ERROR, "IPC invalid message size");
+		ipc_client_close(client);
+		return;
+	}
+	ipc_client_handle_message(client, id, client->read_buffer + header_size, msg_size - header_size);
+}
+
+/* Handles the complete requests of read_buffer, up to the dispatch budget,
+ * before sending anything: pipelined requests are answered by a single
+ * flush. Returns true if complete requests are left. */
+static bool ipc_client_dispatch(struct cg_ipc_client *client) {
+	size_t offset = 0;
+	int budget = CG_IPC_DISPATCH_BUDGET;
+	bool pending = false;
+	while(!client->closing) {
+		size_t msg_size, header_size;
+		uint32_t id;
+		if(!ipc_client_parse_header(client, client->read_buffer + offset, client->read_buffer_size - offset,
+				&msg_size, &header_size, &id)) {
+			wlr_log(WLR_ERROR, "IPC invalid message size");
+			ipc_client_close(client);
+			return false;
+		}
+		if(msg_size == 0 || client->read_buffer_size - offset < msg_size) {
+			if(msg_size > client->read_buffer_cap && !ipc_client_reserve_read(client, msg_size)) {
+				ipc_client_close(client);
+				return false;
+			}
+			break;
+		}
+		if(budget-- == 0) {
+			pending = true;
+			break;
+		}
+		ipc_client_handle_message(client, id, client->read_buffer + offset + header_size, msg_size - header_size);
+		offset += msg_size;
+	}
+
+	memmove(client->read_buffer, client->read_buffer + offset, client->read_buffer_size - offset);
+	client->read_buffer_size -= offset;
+	return pending && !client->closing;
+}
+
+static void ipc_client_defer(struct cg_ipc_client *client) {
+	struct cg_ipc *ipc = client->server->ipc;
+	ipc->deferred++;
+	if(client->deferred) {
+		return;
+	}
+	if(wl_list_empty(&ipc->deferred_clients)) {
+		eventfd_write(ipc->dispatch_fd, 1);
+	}
+	client->deferred = true;
+	wl_list_insert(ipc->deferred_clients.prev, &client->deferred_link);
+	ipc_client_update_mask(client);
+}
+
+/* Each deferred client gets one more budget per event loop iteration. */
+static int ipc_handle_dispatch(int fd, uint32_t mask, void *data) {
+	struct cg_ipc *ipc = data;
+
+	struct wl_list deferred;
+	wl_list_init(&deferred);
+	wl_list_insert_list(&deferred, &ipc->deferred_clients);
+	wl_list_init(&ipc->deferred_clients);
+
+	struct cg_ipc_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &deferred, deferred_link) {
+		wl_list_remove(&client->deferred_link);
+		client->deferred = false;
+		if(ipc_client_dispatch(client)) {
+			ipc_client_defer(client);
+		} else {
+			ipc_client_update_mask(client);
+		}
+	}
+
+	if(wl_list_empty(&ipc->deferred_clients)) {
+		eventfd_t value;
+		eventfd_read(fd, &value);
+	}
+	return 0;
+}
+
+static void ipc_client_read_stream(struct cg_ipc_client *client) {
+	ssize_t sz = recv(client->fd,
+			client->read_buffer + client->read_buffer_size,
+			client->read_buffer_cap - client->read_buffer_size, 0);
+	if(sz == -1) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			wlr_log(WLR_ERROR, "Failed to read from client");
+			ipc_client_close(client);
+		}
+		return;
+	}
+	if(sz == 0) {
+		ipc_client_close(client);
+		return;
+	}
+
+	client->read_buffer_size += sz;
+	if(ipc_client_dispatch(client)) {
+		ipc_client_defer(client);
 	}
 }
 
-static int ipc_handle_read(int fd, uint32_t mask, void *data) {
+static int ipc_handle_client(int fd, uint32_t mask, void *data) {
 	struct cg_ipc_client *client = data;
 
 	if(mask & WL_EVENT_ERROR) {
@@ -128,26 +1437,15 @@ static int ipc_handle_read(int fd, uint32_t mask, void *data) {
 		return 0;
 	}
 
-	ssize_t sz = recv(client->fd,
-			client->read_buffer + client->read_buffer_size,
-			client->read_buffer_cap - client->read_buffer_size, 0);
-
-	if(sz == -1) {
-		wlr_log(WLR_ERROR, "Failed to read from client");
-		ipc_client_destroy(client);
-		return 0;
+	if(mask & WL_EVENT_WRITABLE) {
+		ipc_client_flush(client);
 	}
 
-	client->read_buffer_size += sz;
-
-	while(client->read_buffer_size >= sizeof(uint16_t)) {
-		uint16_t msg_size = *(uint16_t*)client->read_buffer;
-		if(client->read_buffer_size >= msg_size) {
-			ipc_client_handle_message(client, client->read_buffer + sizeof(uint16_t), msg_size - sizeof(uint16_t));
-			memmove(client->read_buffer, client->read_buffer + msg_size, client->read_buffer_size - msg_size);
-			client->read_buffer_size -= msg_size;
+	if((mask & WL_EVENT_READABLE) && !client->closing) {
+		if(client->server->ipc->seqpacket) {
+			ipc_client_read_packet(client);
 		} else {
-			break;
+			ipc_client_read_stream(client);
 		}
 	}
 
@@ -157,7 +1455,7 @@ static int ipc_handle_read(int fd, uint32_t mask, void *data) {
 static int ipc_handle_connection(int fd, uint32_t mask, void *data) {
 	struct cg_server *server = data;
 
-	int client_fd = accept(fd, NULL, NULL);
+	int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if(client_fd == -1) {
 		wlr_log(WLR_ERROR, "IPC: failed to accept");
 		return 0;
@@ -172,53 +1470,339 @@ static int ipc_handle_connection(int fd, uint32_t mask, void *data) {
 
 	client->server = server;
 	client->fd = client_fd;
-	client->write_buffer_cap = 512;
+	client->version = 1;
 	client->read_buffer_cap = 512;
-	client->write_buffer = malloc(client->write_buffer_cap);
 	client->read_buffer = malloc(client->read_buffer_cap);
-	if(client->write_buffer == NULL || client->read_buffer == NULL) {
+	if(client->read_buffer == NULL) {
 		wlr_log(WLR_ERROR, "malloc() failed");
+		free(client);
 		close(client_fd);
 		return 0;
 	}
 
-	client->read_event_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
-		client_fd, WL_EVENT_READABLE, ipc_handle_read, client);
+	client->event_mask = WL_EVENT_READABLE;
+	client->event_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+		client_fd, client->event_mask, ipc_handle_client, client);
+	if(client->event_source == NULL) {
+		wlr_log(WLR_ERROR, "IPC: failed to add client to the event loop");
+		free(client->read_buffer);
+		free(client);
+		close(client_fd);
+		return 0;
+	}
+
+	wl_list_insert(&server->ipc->clients, &client->link);
 
 	return 0;
 }
 
-void ipc_init(struct cg_server *server) {
-	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if(sock == -1) {
-		wlr_log(WLR_ERROR, "Failed to create ipc socket");
+static void ipc_broadcast(struct cg_ipc *ipc, uint32_t subscription, const void *message, size_t size) {
+	struct cg_ipc_client *client;
+	wl_list_for_each(client, &ipc->clients, link) {
+		if(client->subscriptions & subscription) {
+			ipc_client_queue(client, 0, message, size, -1);
+		}
+	}
+}
+
+static void ipc_flush_cursor(void *data) {
+	struct cg_ipc *ipc = data;
+	struct wlr_cursor *cursor = ipc->server->seat->cursor;
+
+	ipc->cursor_idle = NULL;
+	if(cursor->x == ipc->cursor_x && cursor->y == ipc->cursor_y) {
 		return;
 	}
+	ipc->cursor_x = cursor->x;
+	ipc->cursor_y = cursor->y;
+
+	struct cg_ipc_cursor_event event = {
+		.event = CG_IPC_EVENT_CURSOR,
+		.seq = ipc->cursor_seq,
+		.time_msec = ipc->cursor_time_msec,
+		.x = cursor->x,
+		.y = cursor->y,
+	};
+	ipc_broadcast(ipc, CG_IPC_SUBSCRIBE_CURSOR, &event, sizeof(event));
+}
 
-	struct sockaddr_un *sockaddr = calloc(1, sizeof(struct sockaddr_un));
-	sockaddr->sun_family = AF_UNIX;
-	const char *dir = getenv("XDG_RUNTIME_DIR");
-	if(!dir) {
-		wlr_log(WLR_ERROR, "Cannot create ipc socket: missing $XDG_RUNTIME_DIR");
+void ipc_notify_cursor_motion(struct cg_server *server, uint32_t time_msec) {
+	struct cg_ipc *ipc = server->ipc;
+	if(ipc == NULL || !(ipc->subscriptions & CG_IPC_SUBSCRIBE_CURSOR)) {
 		return;
 	}
-	if((size_t)snprintf(sockaddr->sun_path, sizeof(sockaddr->sun_path), "%s/cage-ipc.sock", dir) >= sizeof(sockaddr->sun_path)) {
-		wlr_log(WLR_ERROR, "Cannot create ipc socket: missing $XDG_RUNTIME_DIR");
+
+	ipc->cursor_seq++;
+	ipc->cursor_time_msec = time_msec;
+	if(ipc->cursor_idle == NULL) {
+		ipc->cursor_idle = wl_event_loop_add_idle(wl_display_get_event_loop(server->wl_display),
+			ipc_flush_cursor, ipc);
+	}
+}
+
+void ipc_notify_view(struct cg_view *view, enum cg_ipc_view_event_type type) {
+	struct cg_ipc *ipc = view->server->ipc;
+	if(ipc == NULL || !(ipc->subscriptions & CG_IPC_SUBSCRIBE_VIEWS)) {
 		return;
 	}
 
-	unlink(sockaddr->sun_path);
+	size_t size;
+	char *message = ipc_view_event(view, type, &size);
+	if(message == NULL) {
+		wlr_log(WLR_ERROR, "malloc() failed");
+		return;
+	}
+	ipc_broadcast(ipc, CG_IPC_SUBSCRIBE_VIEWS, message, size);
+	free(message);
+}
 
-	if(bind(sock, (struct sockaddr*)sockaddr, sizeof(struct sockaddr_un)) == -1) {
-		wlr_log(WLR_ERROR, "Cannot bind IPC socket");
+/* A commit without damage information repaints the whole buffer. */
+void ipc_notify_damage(struct cg_output *output, const struct wlr_output_state *state) {
+	struct cg_ipc *ipc = output->server->ipc;
+	if(ipc == NULL || !(ipc->subscriptions & CG_IPC_SUBSCRIBE_DAMAGE) ||
+			!(state->committed & WLR_OUTPUT_STATE_BUFFER) || state->buffer == NULL) {
 		return;
 	}
 
-	if(listen(sock, 1) == -1) {
-		wlr_log(WLR_ERROR, "Cannot listen IPC socket");
+	struct cg_ipc_damage_event event = {
+		.event = CG_IPC_EVENT_DAMAGE,
+		.commit_seq = output->wlr_output->commit_seq,
+		.width = state->buffer->width,
+		.height = state->buffer->height,
+	};
+	snprintf(event.output, sizeof(event.output), "%s", output->wlr_output->name);
+
+	int count = 1;
+	const pixman_box32_t *boxes;
+	pixman_box32_t full = { 0, 0, event.width, event.height };
+	if(!(state->committed & WLR_OUTPUT_STATE_DAMAGE)) {
+		boxes = &full;
+	} else {
+		boxes = pixman_region32_rectangles(&state->damage, &count);
+		if(count > CG_IPC_MAX_DAMAGE_RECTS) {
+			boxes = pixman_region32_extents(&state->damage);
+			count = 1;
+		}
+	}
+	event.rect_count = count;
+
+	size_t size = sizeof(event) + count * sizeof(struct cg_ipc_damage_rect);
+	char *message = malloc(size);
+	if(message == NULL) {
+		wlr_log(WLR_ERROR, "malloc() failed");
+		return;
+	}
+	memcpy(message, &event, sizeof(event));
+	struct cg_ipc_damage_rect *rects = (struct cg_ipc_damage_rect*)(message + sizeof(event));
+	for(int i = 0; i < count; i++) {
+		rects[i] = (struct cg_ipc_damage_rect){
+			.x = boxes[i].x1,
+			.y = boxes[i].y1,
+			.width = boxes[i].x2 - boxes[i].x1,
+			.height = boxes[i].y2 - boxes[i].y1,
+		};
+	}
+	ipc_broadcast(ipc, CG_IPC_SUBSCRIBE_DAMAGE, message, size);
+	free(message);
+}
+
+/* Render requests are served in order, so the oldest waiter for this
+ * output is the one being answered. */
+void ipc_notify_frame(struct cg_output *output, bool committed, const struct timespec *when) {
+	struct cg_ipc *ipc = output->server->ipc;
+	if(ipc == NULL) {
 		return;
 	}
 
-	wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+	struct cg_ipc_waiter *waiter;
+	wl_list_for_each(waiter, &ipc->frame_waiters, link) {
+		if(waiter->output != output) {
+			continue;
+		}
+		struct cg_ipc_render_frame_reply reply = {
+			.time_nsec = (uint64_t)when->tv_sec * 1000000000 + when->tv_nsec,
+			.committed = committed,
+		};
+		ipc_client_reply(waiter->client, waiter->id, &reply, sizeof(reply));
+		wl_list_remove(&waiter->link);
+		free(waiter);
+		return;
+	}
+}
+
+/* Every waiter for this output is answered by the same present event. */
+void ipc_notify_present(struct cg_output *output, const struct wlr_output_event_present *event) {
+	struct cg_ipc *ipc = output->server->ipc;
+	if(ipc == NULL || wl_list_empty(&ipc->present_waiters)) {
+		return;
+	}
+
+	struct cg_ipc_present_reply reply = {
+		.seq = event->seq,
+		.refresh_nsec = event->refresh,
+		.flags = event->flags,
+		.presented = event->presented,
+	};
+	if(event->presented && event->when != NULL) {
+		reply.time_nsec = (uint64_t)event->when->tv_sec * 1000000000 + event->when->tv_nsec;
+	}
+
+	struct cg_ipc_waiter *waiter, *tmp;
+	wl_list_for_each_safe(waiter, tmp, &ipc->present_waiters, link) {
+		if(waiter->output == output) {
+			ipc_client_reply(waiter->client, waiter->id, &reply, sizeof(reply));
+			wl_list_remove(&waiter->link);
+			free(waiter);
+		}
+	}
+}
+
+static void ipc_cancel_waiters(struct wl_list *waiters, struct cg_output *output) {
+	struct cg_ipc_waiter *waiter, *tmp;
+	wl_list_for_each_safe(waiter, tmp, waiters, link) {
+		if(waiter->output == output) {
+			ipc_client_reply(waiter->client, waiter->id, UNAVAILABLE, sizeof(UNAVAILABLE)-1);
+			wl_list_remove(&waiter->link);
+			free(waiter);
+		}
+	}
+}
+
+void ipc_notify_output_destroy(struct cg_output *output) {
+	struct cg_ipc *ipc = output->server->ipc;
+	if(ipc == NULL) {
+		return;
+	}
+	ipc_cancel_waiters(&ipc->frame_waiters, output);
+	ipc_cancel_waiters(&ipc->present_waiters, output);
+}
+
+/* Binding over the socket of a running instance would silently take its
+ * clients over, so only stale sockets are replaced. */
+static bool ipc_socket_in_use(const struct sockaddr_un *addr, int type) {
+	int sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		return false;
+	}
+	bool in_use = connect(sock, (const struct sockaddr*)addr, sizeof(*addr)) == 0 ||
+		(errno != ECONNREFUSED && errno != ENOENT);
+	close(sock);
+	return in_use;
+}
+
+/* The socket is server->ipc_socket if set, $XDG_RUNTIME_DIR/cage-<display>.sock
+ * otherwise, so that instances on different Wayland displays do not
+ * collide. Its path is exported as CAGE_IPC_SOCKET. */
+void ipc_init(struct cg_server *server, const char *display) {
+	int type = server->ipc_seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(server->ipc_socket != NULL) {
+		if((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", server->ipc_socket) >= sizeof(addr.sun_path)) {
+			wlr_log(WLR_ERROR, "Cannot create IPC socket: path too long");
+			return;
+		}
+	} else {
+		const char *dir = getenv("XDG_RUNTIME_DIR");
+		if(!dir) {
+			wlr_log(WLR_ERROR, "Cannot create IPC socket: missing $XDG_RUNTIME_DIR");
+			return;
+		}
+		if((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/cage-%s.sock", dir, display) >= sizeof(addr.sun_path)) {
+			wlr_log(WLR_ERROR, "Cannot create IPC socket: path too long");
+			return;
+		}
+	}
+
+	if(ipc_socket_in_use(&addr, type)) {
+		wlr_log(WLR_ERROR, "IPC socket %s is in use by another instance", addr.sun_path);
+		return;
+	}
+	unlink(addr.sun_path);
+
+	int sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		wlr_log(WLR_ERROR, "Failed to create ipc socket");
+		return;
+	}
+
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		wlr_log_errno(WLR_ERROR, "Cannot bind IPC socket %s", addr.sun_path);
+		close(sock);
+		return;
+	}
+
+	if(listen(sock, SOMAXCONN) == -1) {
+		wlr_log(WLR_ERROR, "Cannot listen IPC socket");
+		goto error;
+	}
+
+	struct cg_ipc *ipc = calloc(1, sizeof(struct cg_ipc));
+	if(ipc == NULL) {
+		wlr_log(WLR_ERROR, "calloc() failed");
+		goto error;
+	}
+	ipc->server = server;
+	ipc->seqpacket = server->ipc_seqpacket;
+	ipc->fd = sock;
+	memcpy(ipc->path, addr.sun_path, sizeof(ipc->path));
+	wl_list_init(&ipc->clients);
+	wl_list_init(&ipc->frame_waiters);
+	wl_list_init(&ipc->present_waiters);
+	wl_list_init(&ipc->deferred_clients);
+
+	ipc->dispatch_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(ipc->dispatch_fd == -1) {
+		wlr_log_errno(WLR_ERROR, "Cannot create IPC dispatch eventfd");
+		free(ipc);
+		goto error;
+	}
+	ipc->dispatch_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+		ipc->dispatch_fd, WL_EVENT_READABLE, ipc_handle_dispatch, ipc);
+	ipc->event_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
 		sock, WL_EVENT_READABLE, ipc_handle_connection, server);
+	if(ipc->dispatch_source == NULL || ipc->event_source == NULL) {
+		wlr_log(WLR_ERROR, "Cannot add IPC socket to the event loop");
+		if(ipc->dispatch_source != NULL) {
+			wl_event_source_remove(ipc->dispatch_source);
+		}
+		if(ipc->event_source != NULL) {
+			wl_event_source_remove(ipc->event_source);
+		}
+		close(ipc->dispatch_fd);
+		free(ipc);
+		goto error;
+	}
+	server->ipc = ipc;
+
+	if(setenv("CAGE_IPC_SOCKET", addr.sun_path, true) < 0) {
+		wlr_log_errno(WLR_ERROR, "Unable to set CAGE_IPC_SOCKET");
+	}
+	wlr_log(WLR_DEBUG, "IPC listening on %s", addr.sun_path);
+	return;
+
+error:
+	close(sock);
+	unlink(addr.sun_path);
+}
+
+void ipc_finish(struct cg_server *server) {
+	struct cg_ipc *ipc = server->ipc;
+	if(ipc == NULL) {
+		return;
+	}
+
+	struct cg_ipc_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &ipc->clients, link) {
+		ipc_client_destroy(client);
+	}
+	if(ipc->cursor_idle != NULL) {
+		wl_event_source_remove(ipc->cursor_idle);
+	}
+	wl_event_source_remove(ipc->dispatch_source);
+	close(ipc->dispatch_fd);
+	wl_event_source_remove(ipc->event_source);
+	close(ipc->fd);
+	unlink(ipc->path);
+	free(ipc);
+	server->ipc = NULL;
 }
@@ -1,8 +1,29 @@
 #ifndef CG_IPC_H
 #define CG_IPC_H
 
+#include <time.h>
+
 #include "server.h"
 
-void ipc_init(struct cg_server *server);
+struct cg_output;
+struct cg_view;
+struct wlr_output_event_present;
+struct wlr_output_state;
+
+enum cg_ipc_view_event_type {
+	CG_IPC_VIEW_MAP = 1,
+	CG_IPC_VIEW_UNMAP,
+	CG_IPC_VIEW_FOCUS,
+	CG_IPC_VIEW_TITLE,
+};
+
+void ipc_init(struct cg_server *server, const char *display);
+void ipc_finish(struct cg_server *server);
+void ipc_notify_cursor_motion(struct cg_server *server, uint32_t time_msec);
+void ipc_notify_frame(struct cg_output *output, bool committed, const struct timespec *when);
+void ipc_notify_present(struct cg_output *output, const struct wlr_output_event_present *event);
+void ipc_notify_damage(struct cg_output *output, const struct wlr_output_state *state);
+void ipc_notify_view(struct cg_view *view, enum cg_ipc_view_event_type type);
+void ipc_notify_output_destroy(struct cg_output *output);
 
 #endif
@@ -0,0 +1,266 @@
+/*
+ * Cage: A Wayland kiosk.
+ *
+ * See the LICENSE file accompanying this file.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+#include "log_ring.h"
+
+#define LOG_RING_SIZE 1024 /* entries, a power of two */
+#define LOG_ENTRY_TEXT 240
+
+struct log_entry {
+	uint64_t time_nsec;
+	enum wlr_log_importance importance;
+	char text[LOG_ENTRY_TEXT];
+};
+
+/* Single producer, single consumer: the compositor thread appends entries
+ * at head, the writer thread prints them and advances tail. Entries stay
+ * in place after being printed, so the most recent ones can be dumped
+ * over IPC. When the writer falls behind, new entries are dropped rather
+ * than blocking the event loop. */
+static struct {
+	bool active;
+	enum wlr_log_importance level;
+	uint64_t start_nsec;
+
+	struct log_entry entries[LOG_RING_SIZE];
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+
+	int eventfd;
+	bool writer_sleeping;
+	bool stopping;
+	pthread_t writer;
+} ring;
+
+static const char *const importance_names[] = {
+	[WLR_SILENT] = "",
+	[WLR_ERROR] = "ERROR",
+	[WLR_INFO] = "INFO",
+	[WLR_DEBUG] = "DEBUG",
+};
+
+static uint64_t
+now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+format_entry(char *buf, size_t size, const struct log_entry *entry)
+{
+	uint64_t msec = (entry->time_nsec - ring.start_nsec) / 1000000;
+	return snprintf(buf, size, "%02d:%02d:%02d.%03d [%s] %s\n", (int) (msec / 3600000), (int) (msec / 60000 % 60),
+			(int) (msec / 1000 % 60), (int) (msec % 1000), importance_names[entry->importance], entry->text);
+}
+
+/* wlroots leaves the filtering by level to the callback. Without the writer
+ * thread, before it starts or after it stops, messages go to stderr right
+ * away. */
+static void
+log_callback(enum wlr_log_importance importance, const char *fmt, va_list args)
+{
+	if (importance > ring.level) {
+		return;
+	}
+
+	if (!ring.active) {
+		struct log_entry entry = {
+			.time_nsec = now_nsec(),
+			.importance = importance,
+		};
+		vsnprintf(entry.text, sizeof(entry.text), fmt, args);
+		char line[LOG_ENTRY_TEXT + 64];
+		int n = format_entry(line, sizeof(line), &entry);
+		if (n > 0) {
+			fwrite(line, 1, (size_t) n < sizeof(line) ? (size_t) n : sizeof(line) - 1, stderr);
+		}
+		return;
+	}
+
+	uint64_t head = ring.head;
+	if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+		__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct log_entry *entry = &ring.entries[head % LOG_RING_SIZE];
+	entry->time_nsec = now_nsec();
+	entry->importance = importance;
+	vsnprintf(entry->text, sizeof(entry->text), fmt, args);
+	__atomic_store_n(&ring.head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&ring.writer_sleeping, false, __ATOMIC_SEQ_CST)) {
+		eventfd_write(ring.eventfd, 1);
+	}
+}
+
+static void
+writer_drain(void)
+{
+	char buf[16384];
+	size_t len = 0;
+
+	uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring.tail;
+	uint64_t dropped = __atomic_exchange_n(&ring.dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		len = snprintf(buf, sizeof(buf), "[%" PRIu64 " log messages dropped]\n", dropped);
+	}
+
+	while (tail != head) {
+		if (sizeof(buf) - len < LOG_ENTRY_TEXT + 32) {
+			fwrite(buf, 1, len, stderr);
+			len = 0;
+		}
+		int n = format_entry(buf + len, sizeof(buf) - len, &ring.entries[tail % LOG_RING_SIZE]);
+		len += n < (int) (sizeof(buf) - len) ? (size_t) n : sizeof(buf) - len - 1;
+		tail++;
+		/* The slot may be reused as soon as tail moves past it. */
+		__atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+	}
+
+	if (len > 0) {
+		fwrite(buf, 1, len, stderr);
+	}
+	fflush(stderr);
+}
+
+static void *
+writer_run(void *data)
+{
+	for (;;) {
+		writer_drain();
+
+		__atomic_store_n(&ring.writer_sleeping, true, __ATOMIC_SEQ_CST);
+		bool pending = __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) != ring.tail;
+		if (!pending && __atomic_load_n(&ring.stopping, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if (pending) {
+			__atomic_store_n(&ring.writer_sleeping, false, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		eventfd_t value;
+		eventfd_read(ring.eventfd, &value);
+	}
+
+	return NULL;
+}
+
+/* Forked children, such as the primary client before it execs, have no
+ * writer thread: whatever they log must go to stderr directly. */
+static void
+log_ring_atfork_child(void)
+{
+	ring.active = false;
+}
+
+/* Falls back to logging synchronously if the writer thread cannot be
+ * started. */
+void
+log_ring_init(enum wlr_log_importance level)
+{
+	ring.level = level;
+	ring.start_nsec = now_nsec();
+	wlr_log_init(level, log_callback);
+
+	ring.eventfd = eventfd(0, EFD_CLOEXEC);
+	if (ring.eventfd < 0) {
+		wlr_log_errno(WLR_ERROR, "Cannot create eventfd, logging synchronously");
+		return;
+	}
+
+	/* Process-directed signals must keep going to the main thread, where
+	 * the event loop handles them; the writer inherits a full mask. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&ring.writer, NULL, writer_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		close(ring.eventfd);
+		wlr_log(WLR_ERROR, "Cannot start log writer, logging synchronously");
+		return;
+	}
+
+	pthread_atfork(NULL, NULL, log_ring_atfork_child);
+	ring.active = true;
+}
+
+void
+log_ring_finish(void)
+{
+	if (!ring.active) {
+		return;
+	}
+
+	__atomic_store_n(&ring.stopping, true, __ATOMIC_RELEASE);
+	eventfd_write(ring.eventfd, 1);
+	pthread_join(ring.writer, NULL);
+	close(ring.eventfd);
+	/* Whatever is logged from now on goes to stderr directly. */
+	ring.active = false;
+}
+
+void
+log_ring_set_level(enum wlr_log_importance level)
+{
+	ring.level = level;
+	wlr_log_init(level, log_callback);
+}
+
+/* Formats the last count entries that fit in buf, oldest first. Returns the
+ * length of the text, which is not NUL-terminated. */
+size_t
+log_ring_dump(char *buf, size_t size, size_t count)
+{
+	if (!ring.active) {
+		return 0;
+	}
+
+	uint64_t head = ring.head;
+	uint64_t first = head;
+	size_t total = 0;
+	while (first > 0 && head - first < count && head - first < LOG_RING_SIZE) {
+		int n = format_entry(NULL, 0, &ring.entries[(first - 1) % LOG_RING_SIZE]);
+		if (total + n > size) {
+			break;
+		}
+		total += n;
+		first--;
+	}
+
+	size_t len = 0;
+	char line[LOG_ENTRY_TEXT + 64];
+	for (uint64_t i = first; i < head; i++) {
+		int n = format_entry(line, sizeof(line), &ring.entries[i % LOG_RING_SIZE]);
+		if (n < 0 || (size_t) n >= sizeof(line) || len + n > size) {
+			break;
+		}
+		memcpy(buf + len, line, n);
+		len += n;
+	}
+	return len;
+}
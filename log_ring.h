@@ -0,0 +1,12 @@
+#ifndef CG_LOG_RING_H
+#define CG_LOG_RING_H
+
+#include <stddef.h>
+#include <wlr/util/log.h>
+
+void log_ring_init(enum wlr_log_importance level);
+void log_ring_finish(void);
+void log_ring_set_level(enum wlr_log_importance level);
+size_t log_ring_dump(char *buf, size_t size, size_t count);
+
+#endif
@@ -13,6 +13,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
@@ -22,6 +23,7 @@
 #include <wlr/backend/x11.h>
 #endif
 #include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_matrix.h>
@@ -31,12 +33,16 @@
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/interfaces/wlr_output.h>
+#include <wlr/util/box.h>
 #include <wlr/util/log.h>
 #include <wlr/util/region.h>
 
+#include "frame_stats.h"
+#include "ipc.h"
 #include "output.h"
 #include "seat.h"
 #include "server.h"
+#include "shared_state.h"
 #include "view.h"
 #if CAGE_HAS_XWAYLAND
 #include "xwayland.h"
@@ -132,29 +138,324 @@ output_disable(struct cg_output *output)
 	output_layout_remove(output);
 }
 
+static uint64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
 static bool
-output_apply_config(struct cg_output *output, struct wlr_output_configuration_head_v1 *head, bool test_only)
+is_nested_output(struct cg_output *output)
 {
-	struct wlr_output_state state = {0};
-	wlr_output_head_v1_state_apply(&head->state, &state);
+	if (wlr_output_is_wl(output->wlr_output)) {
+		return true;
+	}
+#if WLR_HAS_X11_BACKEND
+	if (wlr_output_is_x11(output->wlr_output)) {
+		return true;
+	}
+#endif
+	return false;
+}
 
-	if (test_only) {
-		bool ret = wlr_output_test_state(output->wlr_output, &state);
-		return ret;
+/* Returns the delay in milliseconds until the first vblank of the host
+ * predicted at least interval_nsec from now, or -1 if the host has not sent
+ * presentation feedback lately. */
+static int
+output_predict_vblank_delay(struct cg_output *output, uint64_t interval_nsec)
+{
+	uint64_t refresh = output->present_refresh_nsec;
+	if (refresh == 0) {
+		return -1;
 	}
 
-	/* Apply output configuration */
-	if (!wlr_output_commit_state(output->wlr_output, &state)) {
-		return false;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t now_nsec = timespec_to_nsec(&now);
+	uint64_t last = output->last_present_nsec;
+	if (now_nsec < last || now_nsec - last > (uint64_t) FORCED_REFRESH_FEEDBACK_TIMEOUT_MS * 1000000) {
+		return -1;
 	}
 
-	if (head->state.enabled) {
-		output_layout_add(output, head->state.x, head->state.y);
+	/* Round to the nearest vblank, but never one already past. */
+	uint64_t vblanks = (now_nsec + interval_nsec - last + refresh / 2) / refresh;
+	uint64_t target = last + vblanks * refresh;
+	while (target <= now_nsec) {
+		target += refresh;
+	}
+	/* Round up, so that the commit lands right after the vblank and the
+	 * host has a whole period to pick it up. */
+	return (target - now_nsec + 999999) / 1000000;
+}
+
+/* Nested, the forced refresh follows the vblanks of the host, predicted from
+ * its presentation feedback, rather than drifting against them; the plain
+ * timer is only a fallback for when the host stops sending feedback. */
+static void
+output_update_refresh_timer(struct cg_output *output)
+{
+	int hz = output->force_refresh_hz;
+	if (hz == 0 || output->server->lockstep || output->idle) {
+		wl_event_source_timer_update(output->timer, 0);
+		return;
+	}
+
+	int mhz = hz * 1000;
+	if (hz == FORCED_REFRESH_AUTO) {
+		mhz = output->wlr_output->refresh > 0 ? output->wlr_output->refresh : FORCED_REFRESH_DEFAULT_HZ * 1000;
+	}
+	int delay = is_nested_output(output) ? output_predict_vblank_delay(output, 1000000000000ULL / mhz) : -1;
+	if (delay < 0) {
+		delay = (1000000 + mhz / 2) / mhz;
+	}
+	wl_event_source_timer_update(output->timer, delay > 0 ? delay : 1);
+}
+
+/* From presentation feedback if any, from the mode otherwise; 0 if
+ * unknown. */
+static uint64_t
+output_refresh_nsec(struct cg_output *output)
+{
+	if (output->present_refresh_nsec != 0) {
+		return output->present_refresh_nsec;
+	}
+	if (output->wlr_output->refresh > 0) {
+		return 1000000000000ULL / output->wlr_output->refresh;
+	}
+	return 0;
+}
+
+/* First vblank after now_nsec, predicted from the last presentation; 0 if
+ * there was none lately. */
+static uint64_t
+output_next_vblank_nsec(struct cg_output *output, uint64_t now_nsec)
+{
+	uint64_t refresh = output_refresh_nsec(output);
+	uint64_t last = output->last_present_nsec;
+	if (refresh == 0 || last == 0 || now_nsec < last ||
+	    now_nsec - last > (uint64_t) FORCED_REFRESH_FEEDBACK_TIMEOUT_MS * 1000000) {
+		return 0;
+	}
+	return last + ((now_nsec - last) / refresh + 1) * refresh;
+}
+
+/* Time kept before a vblank to render, 0 if rendering is not delayed. In
+ * auto mode, the slowest commits seen lately plus a millisecond of slack. */
+static uint64_t
+output_max_render_time_nsec(struct cg_output *output)
+{
+	if (output->max_render_time_ms == OUTPUT_DELAY_AUTO) {
+		uint64_t nsec = frame_stats_histogram_percentile(&output->frame_stats.commit_duration, 99);
+		return nsec > 0 ? nsec + 1000000 : 0;
+	}
+	return output->max_render_time_ms > 0 ? (uint64_t) output->max_render_time_ms * 1000000 : 0;
+}
+
+/* The frame event comes right after a vblank. With a max render time,
+ * rendering is delayed until that long before the next vblank, so that
+ * client commits landing in the meantime make it into this frame instead
+ * of waiting for the next. Returns when to render, 0 for right away. */
+static uint64_t
+output_repaint_deadline(struct cg_output *output, uint64_t now_nsec)
+{
+	uint64_t max_render = output_max_render_time_nsec(output);
+	uint64_t vblank = output_next_vblank_nsec(output, now_nsec);
+	if (max_render == 0 || vblank == 0 || vblank <= now_nsec + max_render) {
+		return 0;
+	}
+	return vblank - max_render;
+}
+
+/* When the frame after the one just rendered will be, 0 if unknown: right
+ * after the vblank it is presented at, or max render time before the one
+ * after that. */
+static uint64_t
+output_next_repaint_nsec(struct cg_output *output, uint64_t now_nsec)
+{
+	uint64_t vblank = output_next_vblank_nsec(output, now_nsec);
+	uint64_t max_render = output_max_render_time_nsec(output);
+	uint64_t refresh = output_refresh_nsec(output);
+	if (vblank == 0) {
+		return 0;
+	}
+	return max_render > 0 && max_render < refresh ? vblank + refresh - max_render : vblank;
+}
+
+static bool
+output_shows_view(struct cg_output *output, struct cg_view *view)
+{
+	struct wlr_box output_box, view_box, intersection;
+	wlr_output_layout_get_box(output->server->output_layout, output->wlr_output, &output_box);
+	view_box.x = view->lx;
+	view_box.y = view->ly;
+	view->impl->get_geometry(view, &view_box.width, &view_box.height);
+	return wlr_box_intersection(&intersection, &output_box, &view_box);
+}
+
+/* Also starts measuring how long the clients of the views on this output
+ * take to draw their next frame. */
+static void
+output_send_frame_done(struct cg_output *output, struct timespec *now)
+{
+	wlr_scene_output_send_frame_done(output->scene_output, now);
+
+	uint64_t now_nsec = timespec_to_nsec(now);
+	output->last_frame_done_nsec = now_nsec;
+	struct cg_view *view;
+	wl_list_for_each (view, &output->server->views, link) {
+		if (output_shows_view(output, view)) {
+			view->frame_done_nsec = now_nsec;
+		}
+	}
+}
+
+/* Clients start drawing their next frame when they get frame_done. Sent
+ * right after the commit, they draw a whole refresh ahead and show stale
+ * input; delaying it lets them draw as late as they can and still make the
+ * next repaint. In auto mode, the delay leaves room for the slowest view
+ * of the output. Returns the delay in milliseconds, 0 to send it right
+ * away. */
+static int
+output_frame_done_delay(struct cg_output *output, uint64_t now_nsec)
+{
+	if (output->frame_done_delay_ms != OUTPUT_DELAY_AUTO) {
+		return output->frame_done_delay_ms;
+	}
+
+	uint64_t render_nsec = 0;
+	struct cg_view *view;
+	wl_list_for_each (view, &output->server->views, link) {
+		if (view->render_time_nsec > render_nsec && output_shows_view(output, view)) {
+			render_nsec = view->render_time_nsec;
+		}
+	}
+	if (render_nsec == 0) {
+		return 0;
+	}
+
+	/* Leave a millisecond of slack */
+	uint64_t needed_nsec = render_nsec + 1000000;
+	uint64_t repaint = output_next_repaint_nsec(output, now_nsec);
+	if (repaint == 0) {
+		/* Without presentation feedback, assume the next repaint is a
+		 * refresh away. */
+		uint64_t refresh_nsec = output_refresh_nsec(output);
+		return refresh_nsec > needed_nsec ? (refresh_nsec - needed_nsec) / 1000000 : 0;
+	}
+	return repaint > now_nsec + needed_nsec ? (repaint - needed_nsec - now_nsec) / 1000000 : 0;
+}
+
+static int
+handle_frame_done_timeout(void *data)
+{
+	struct cg_output *output = data;
+
+	if (output->wlr_output->enabled && output->scene_output) {
+		struct timespec now = {0};
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		output_send_frame_done(output, &now);
+	}
+	return 0;
+}
+
+static void
+output_render(struct cg_output *output)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	shared_state_update_frame(output, &now);
+	uint64_t start_nsec = timespec_to_nsec(&now);
+	frame_stats_frame(&output->frame_stats, start_nsec);
+
+	bool needs_frame = wlr_scene_output_needs_frame(output->scene_output);
+	bool committed = wlr_scene_output_commit(output->scene_output, NULL) && needs_frame;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t end_nsec = timespec_to_nsec(&now);
+	frame_stats_commit(&output->frame_stats, start_nsec, end_nsec, committed);
+	int delay = output->server->lockstep ? 0 : output_frame_done_delay(output, end_nsec);
+	if (delay > 0) {
+		wl_event_source_timer_update(output->frame_done_timer, delay);
 	} else {
-		output_layout_remove(output);
+		output_send_frame_done(output, &now);
 	}
 
-	return true;
+	if (output->frame_requests > 0) {
+		output->frame_requests--;
+		ipc_notify_frame(output, committed, &now);
+		/* Without a commit no frame event follows to serve the
+		 * requests left. */
+		if (output->frame_requests > 0 && !output->wlr_output->frame_pending) {
+			wlr_output_schedule_frame(output->wlr_output);
+		}
+	}
+}
+
+/* Once the scene of an output has not been damaged for
+ * server->idle_timeout_sec, frame events are served at IDLE_REFRESH_HZ and
+ * the forced refresh stops, so that clients asking for frame callbacks
+ * without drawing anything stop waking the CPU at the refresh rate. Damage
+ * or input switches back to full rate. */
+static void
+output_update_idle(struct cg_output *output, bool damaged, uint64_t now_nsec)
+{
+	int timeout = output->server->idle_timeout_sec;
+	if (damaged || timeout <= 0 || output->last_damage_nsec == 0) {
+		output->last_damage_nsec = now_nsec;
+		if (output->idle) {
+			wlr_log(WLR_DEBUG, "Output %s leaves idle mode", output->wlr_output->name);
+			output->idle = false;
+			output_update_refresh_timer(output);
+		}
+		return;
+	}
+
+	if (!output->idle && now_nsec - output->last_damage_nsec >= (uint64_t) timeout * 1000000000) {
+		wlr_log(WLR_DEBUG, "Output %s enters idle mode", output->wlr_output->name);
+		output->idle = true;
+		output_update_refresh_timer(output);
+	}
+}
+
+void
+output_notify_activity(struct cg_server *server)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	struct cg_output *output;
+	wl_list_for_each (output, &server->outputs, link) {
+		bool was_idle = output->idle;
+		output_update_idle(output, true, timespec_to_nsec(&now));
+		/* A trickled frame may be held on the repaint timer */
+		if (was_idle && output->wlr_output->enabled) {
+			wl_event_source_timer_update(output->repaint_timer, 0);
+			output->repaint_nsec = 0;
+			wlr_output_schedule_frame(output->wlr_output);
+		}
+	}
+}
+
+/* Under an fps cap, a frame, or a frame_done, coming too soon after the
+ * last one at last_nsec is held back. Within half a refresh of the deadline
+ * it goes out, to stay on the vblank grid. Returns when it may go out, 0
+ * for right away. */
+static uint64_t
+output_fps_cap_deadline(struct cg_output *output, uint64_t last_nsec, uint64_t now_nsec)
+{
+	int fps = output->max_fps;
+	if (output->idle && (fps <= 0 || fps > IDLE_REFRESH_HZ)) {
+		fps = IDLE_REFRESH_HZ;
+	}
+	if (fps <= 0 || last_nsec == 0) {
+		return 0;
+	}
+
+	uint64_t deadline = last_nsec + 1000000000 / fps;
+	if (now_nsec + output_refresh_nsec(output) / 2 >= deadline) {
+		return 0;
+	}
+	return deadline;
 }
 
 static void
@@ -163,16 +464,257 @@ handle_output_frame(struct wl_listener *listener, void *data)
 	struct cg_output *output = wl_container_of(listener, output, frame);
 
 	wl_event_source_timer_update(output->timer, 0);
+	wl_event_source_timer_update(output->occlusion_timer, 0);
+	if (output->occluded) {
+		wlr_log(WLR_DEBUG, "Output %s is visible again", output->wlr_output->name);
+		output->occluded = false;
+	}
 
 	if (!output->wlr_output->enabled || !output->scene_output) {
 		return;
 	}
 
-	wlr_scene_output_commit(output->scene_output, NULL);
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t now_nsec = timespec_to_nsec(&now);
+	output_update_idle(output, wlr_scene_output_needs_frame(output->scene_output), now_nsec);
+
+	/* In lockstep mode, frames are rendered on request only; the frame
+	 * event merely tells us when the previous one is out of the way. */
+	if (output->server->lockstep && output->frame_requests == 0) {
+		return;
+	}
+
+	uint64_t deadline = 0;
+	if (!output->server->lockstep) {
+		uint64_t cap = output_fps_cap_deadline(output, output->frame_stats.last_frame_nsec, now_nsec);
+		deadline = output_repaint_deadline(output, now_nsec);
+		if (cap > deadline) {
+			deadline = cap;
+		}
+	}
+
+	/* Frame events also come whenever a frame is scheduled while none is
+	 * pending, on each client commit for instance: a repaint already
+	 * scheduled is only ever moved earlier, so that they cannot push it
+	 * back indefinitely. */
+	if (output->repaint_nsec != 0) {
+		if (deadline != 0 && deadline >= output->repaint_nsec) {
+			return;
+		}
+		wl_event_source_timer_update(output->repaint_timer, 0);
+		output->repaint_nsec = 0;
+	}
+	int delay = deadline > now_nsec ? (deadline - now_nsec) / 1000000 : 0;
+	if (delay > 0) {
+		output->repaint_nsec = deadline;
+		wl_event_source_timer_update(output->repaint_timer, delay);
+		return;
+	}
+
+	output_render(output);
+}
+
+static int
+handle_repaint_timeout(void *data)
+{
+	struct cg_output *output = data;
+	output->repaint_nsec = 0;
+
+	/* A render_frame request may have committed in the meantime. */
+	if (output->wlr_output->enabled && output->scene_output && !output->wlr_output->frame_pending) {
+		output_render(output);
+	}
+	return 0;
+}
+
+void
+output_request_frame(struct cg_output *output)
+{
+	output->frame_requests++;
+
+	/* Committing on top of a pending page flip would fail; the frame
+	 * event will pick the request up. */
+	if (output->wlr_output->enabled && output->scene_output && !output->wlr_output->frame_pending) {
+		output_render(output);
+	}
+}
+
+/* In lockstep mode nothing renders on its own: the forced refresh and any
+ * deferred repaint are cancelled, and a deferred frame_done goes out now
+ * since frames are no longer paced. Leaving it, they resume and a frame
+ * catches up with whatever was damaged in the meantime. */
+void
+output_set_lockstep(struct cg_server *server, bool lockstep)
+{
+	server->lockstep = lockstep;
+
+	struct cg_output *output;
+	wl_list_for_each (output, &server->outputs, link) {
+		if (lockstep) {
+			wl_event_source_timer_update(output->repaint_timer, 0);
+			output->repaint_nsec = 0;
+			wl_event_source_timer_update(output->frame_done_timer, 0);
+			if (output->wlr_output->enabled && output->scene_output) {
+				struct timespec now = {0};
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				output_send_frame_done(output, &now);
+			}
+		} else if (output->wlr_output->enabled) {
+			wlr_output_schedule_frame(output->wlr_output);
+		}
+		output_update_refresh_timer(output);
+	}
+}
+
+bool
+output_parse_refresh(const char *str, int *hz)
+{
+	if (strcmp(str, "auto") == 0) {
+		*hz = FORCED_REFRESH_AUTO;
+		return true;
+	}
+
+	char *end;
+	long value = strtol(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || value < 0 || value > 1000) {
+		return false;
+	}
+	*hz = value;
+	return true;
+}
+
+/* A named rule beats the default one; among rules of the same kind, the
+ * last one given wins. enable/disable_force_refresh override the rules,
+ * enabling it at FORCED_REFRESH_DEFAULT_HZ if none gives a rate. */
+int
+output_default_refresh(struct cg_output *output)
+{
+	struct cg_server *server = output->server;
+	if (server->force_refresh_override && !server->force_refresh) {
+		return 0;
+	}
+
+	int hz = 0;
+	bool named = false;
+	struct cg_refresh_rule *rule;
+	wl_array_for_each (rule, &server->refresh_rules) {
+		if (rule->output == NULL && !named) {
+			hz = rule->hz;
+		} else if (rule->output != NULL && strcmp(rule->output, output->wlr_output->name) == 0) {
+			hz = rule->hz;
+			named = true;
+		}
+	}
+	if (hz == 0 && server->force_refresh_override) {
+		hz = FORCED_REFRESH_DEFAULT_HZ;
+	}
+	return hz;
+}
+
+bool
+output_parse_delay(const char *str, int *ms)
+{
+	if (strcmp(str, "auto") == 0) {
+		*ms = OUTPUT_DELAY_AUTO;
+		return true;
+	}
+
+	char *end;
+	long value = strtol(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || value < 0 || value > 1000) {
+		return false;
+	}
+	*ms = value;
+	return true;
+}
+
+void
+output_set_max_render_time(struct cg_output *output, int ms)
+{
+	output->max_render_time_ms = ms;
+}
+
+void
+output_set_max_fps(struct cg_output *output, int fps)
+{
+	output->max_fps = fps;
+}
+
+void
+output_set_frame_done_delay(struct cg_output *output, int ms)
+{
+	output->frame_done_delay_ms = ms;
+}
+
+void
+output_set_force_refresh(struct cg_output *output, int hz)
+{
+	output->force_refresh_hz = hz;
+	output_update_refresh_timer(output);
+}
+
+static void
+handle_output_present(struct wl_listener *listener, void *data)
+{
+	struct cg_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+
+	if (event->presented && event->when != NULL) {
+		output->last_present_nsec = timespec_to_nsec(event->when);
+		if (event->refresh > 0) {
+			output->present_refresh_nsec = event->refresh;
+		}
+	}
+
+	shared_state_update_present(output, event);
+	frame_stats_present(&output->frame_stats, event);
+	ipc_notify_present(output, event);
+}
+
+/* Hosts stop sending frame events to hidden windows, which would freeze the
+ * application. If the frame of a nested output is still pending after
+ * OFFSCREEN_TIMEOUT_MS, the output is considered hidden and its clients are
+ * paced at the offscreen rate, without rendering, until the host sends a
+ * frame event again. A forced refresh or lockstep takes precedence. */
+static void
+output_watch_occlusion(struct cg_output *output)
+{
+	struct cg_server *server = output->server;
+	if (output->occluded || server->offscreen_hz <= 0 || output->force_refresh_hz != 0 || server->lockstep ||
+	    !is_nested_output(output)) {
+		return;
+	}
+	wl_event_source_timer_update(output->occlusion_timer, OFFSCREEN_TIMEOUT_MS);
+}
+
+static int
+handle_occlusion_timeout(void *data)
+{
+	struct cg_output *output = data;
+	struct cg_server *server = output->server;
+
+	if (!output->wlr_output->enabled || !output->scene_output || server->offscreen_hz <= 0 ||
+	    output->force_refresh_hz != 0 || server->lockstep) {
+		return 0;
+	}
+
+	if (!output->occluded) {
+		if (!output->wlr_output->frame_pending) {
+			return 0;
+		}
+		wlr_log(WLR_DEBUG, "No frame event for output %s in %d ms, assuming it is hidden",
+			output->wlr_output->name, OFFSCREEN_TIMEOUT_MS);
+		output->occluded = true;
+	}
 
 	struct timespec now = {0};
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(output->scene_output, &now);
+	output_send_frame_done(output, &now);
+
+	int delay = (1000 + server->offscreen_hz / 2) / server->offscreen_hz;
+	wl_event_source_timer_update(output->occlusion_timer, delay > 0 ? delay : 1);
+	return 0;
 }
 
 static void
@@ -185,11 +727,21 @@ handle_output_commit(struct wl_listener *listener, void *data)
 	 * - output layout change will also be called if needed to position the views
 	 * - always update output manager configuration even if the output is now disabled */
 
-	if (event->state->committed & OUTPUT_CONFIG_UPDATED) {
+	if ((event->state->committed & OUTPUT_CONFIG_UPDATED) && !output->server->output_config_pending) {
 		update_output_manager_config(output->server);
 	}
 
-	wl_event_source_timer_update(output->timer, FORCED_REFRESH_DELAY);
+	if ((event->state->committed & WLR_OUTPUT_STATE_BUFFER) && event->state->buffer) {
+		wlr_buffer_unlock(output->last_buffer);
+		output->last_buffer = wlr_buffer_lock(event->state->buffer);
+		ipc_notify_damage(output, event->state);
+		output_watch_occlusion(output);
+	} else if (!output->wlr_output->enabled && output->last_buffer) {
+		wlr_buffer_unlock(output->last_buffer);
+		output->last_buffer = NULL;
+	}
+
+	output_update_refresh_timer(output);
 }
 
 static void
@@ -211,10 +763,28 @@ static int handle_frame_timeout(void *data)
 		return 0;
 	}
 
-	if (output->server->force_refresh) {
-		wlr_output_send_frame(output->wlr_output);
+	if (output->force_refresh_hz == 0 || output->server->lockstep || output->idle || !output->scene_output) {
+		return 0;
+	}
+
+	/* With nothing new to show, a frame event would only go through the
+	 * whole scene commit path to find that out: just let the clients
+	 * draw their next frame, and keep the timer going since no commit
+	 * will re-arm it. Under an fps cap, ticks within the cap interval of
+	 * the last frame_done are skipped. */
+	if (!wlr_scene_output_needs_frame(output->scene_output)) {
+		struct timespec now = {0};
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t now_nsec = timespec_to_nsec(&now);
+		if (output_fps_cap_deadline(output, output->last_frame_done_nsec, now_nsec) == 0) {
+			output_send_frame_done(output, &now);
+		}
+		output_update_idle(output, false, now_nsec);
+		output_update_refresh_timer(output);
+		return 0;
 	}
 
+	wlr_output_send_frame(output->wlr_output);
 	return 0;
 }
 
@@ -223,24 +793,14 @@ handle_output_layout_change(struct wl_listener *listener, void *data)
 {
 	struct cg_server *server = wl_container_of(listener, server, output_layout_change);
 
+	if (server->output_config_pending) {
+		return;
+	}
+
 	view_position_all(server);
 	update_output_manager_config(server);
 }
 
-static bool
-is_nested_output(struct cg_output *output)
-{
-	if (wlr_output_is_wl(output->wlr_output)) {
-		return true;
-	}
-#if WLR_HAS_X11_BACKEND
-	if (wlr_output_is_x11(output->wlr_output)) {
-		return true;
-	}
-#endif
-	return false;
-}
-
 static void
 output_destroy(struct cg_output *output)
 {
@@ -253,10 +813,17 @@ output_destroy(struct cg_output *output)
 	wl_list_remove(&output->commit.link);
 	wl_list_remove(&output->request_state.link);
 	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
 	wl_list_remove(&output->link);
 	wl_event_source_remove(output->timer);
+	wl_event_source_remove(output->occlusion_timer);
+	wl_event_source_remove(output->repaint_timer);
+	wl_event_source_remove(output->frame_done_timer);
 
 	output_layout_remove(output);
+	shared_state_remove_output(output);
+	ipc_notify_output_destroy(output);
+	wlr_buffer_unlock(output->last_buffer);
 
 	free(output);
 
@@ -299,9 +866,19 @@ handle_new_output(struct wl_listener *listener, void *data)
 
 	output->timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->wl_display),
 				handle_frame_timeout, output);
+	output->occlusion_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->wl_display),
+							  handle_occlusion_timeout, output);
+	output->repaint_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->wl_display),
+							handle_repaint_timeout, output);
+	output->frame_done_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->wl_display),
+							   handle_frame_done_timeout, output);
 	output->wlr_output = wlr_output;
 	wlr_output->data = output;
 	output->server = server;
+	output->force_refresh_hz = output_default_refresh(output);
+	output->max_render_time_ms = server->max_render_time_ms;
+	output->frame_done_delay_ms = server->frame_done_delay_ms;
+	output->max_fps = server->max_fps;
 
 	wl_list_insert(&server->outputs, &output->link);
 
@@ -313,6 +890,10 @@ handle_new_output(struct wl_listener *listener, void *data)
 	wl_signal_add(&wlr_output->events.destroy, &output->destroy);
 	output->frame.notify = handle_output_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
+	output->present.notify = handle_output_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
+
+	shared_state_add_output(output);
 
 	output->scene_output = wlr_scene_output_create(server->scene, wlr_output);
 	if (!output->scene_output) {
@@ -361,6 +942,18 @@ handle_new_output(struct wl_listener *listener, void *data)
 	update_output_manager_config(output->server);
 }
 
+struct cg_output *
+output_from_name(struct cg_server *server, const char *name)
+{
+	struct cg_output *output;
+	wl_list_for_each (output, &server->outputs, link) {
+		if (strcmp(output->wlr_output->name, name) == 0) {
+			return output;
+		}
+	}
+	return NULL;
+}
+
 void
 output_set_window_title(struct cg_output *output, const char *title)
 {
@@ -380,20 +973,45 @@ output_set_window_title(struct cg_output *output, const char *title)
 	}
 }
 
+/* All heads are tested and committed at once, so that a configuration is
+ * either applied as a whole or not at all. The commit and layout events it
+ * causes are collapsed into a single relayout and configuration update. */
 static bool
 output_config_apply(struct cg_server *server, struct wlr_output_configuration_v1 *config, bool test_only)
 {
-	struct wlr_output_configuration_head_v1 *head;
-
-	wl_list_for_each (head, &config->heads, link) {
-		struct cg_output *output = head->state.output->data;
+	size_t states_len;
+	struct wlr_backend_output_state *states = wlr_output_configuration_v1_build_state(config, &states_len);
+	if (states == NULL) {
+		wlr_log(WLR_ERROR, "Failed to build output configuration state");
+		return false;
+	}
 
-		if (!output_apply_config(output, head, test_only)) {
-			return false;
+	bool ok = wlr_backend_test(server->backend, states, states_len);
+	if (ok && !test_only) {
+		server->output_config_pending = true;
+		ok = wlr_backend_commit(server->backend, states, states_len);
+		if (ok) {
+			struct wlr_output_configuration_head_v1 *head;
+			wl_list_for_each (head, &config->heads, link) {
+				struct cg_output *output = head->state.output->data;
+				if (head->state.enabled) {
+					output_layout_add(output, head->state.x, head->state.y);
+				} else {
+					output_layout_remove(output);
+				}
+			}
 		}
+		server->output_config_pending = false;
+
+		view_position_all(server);
+		update_output_manager_config(server);
 	}
 
-	return true;
+	for (size_t i = 0; i < states_len; i++) {
+		wlr_output_state_finish(&states[i].base);
+	}
+	free(states);
+	return ok;
 }
 
 void
@@ -4,21 +4,65 @@
 #include <wayland-server-core.h>
 #include <wlr/types/wlr_output.h>
 
+#include "frame_stats.h"
 #include "server.h"
 #include "view.h"
 
-#define FORCED_REFRESH_DELAY 7 /* milliseconds, ~144 Hz */
+#define FORCED_REFRESH_DEFAULT_HZ 144
+#define FORCED_REFRESH_AUTO -1 /* follow the refresh rate of the current mode */
+/* Forced refresh falls back to a free-running timer past this long without
+ * presentation feedback from the host */
+#define FORCED_REFRESH_FEEDBACK_TIMEOUT_MS 250
+/* A nested output whose frame stays pending that long is considered hidden
+ * by the host, and then paced at server->offscreen_hz */
+#define OFFSCREEN_TIMEOUT_MS 250
+#define OFFSCREEN_REFRESH_DEFAULT_HZ 10
+/* Frame rate of outputs in idle mode, see server->idle_timeout_sec */
+#define IDLE_REFRESH_HZ 1
+#define OUTPUT_DELAY_AUTO -1 /* derived from measured render times */
 
 struct cg_output {
 	struct cg_server *server;
 	struct wlr_output *wlr_output;
 	struct wlr_scene_output *scene_output;
 	struct wl_event_source *timer;
+	struct wl_event_source *occlusion_timer;
+	bool occluded;
 
 	struct wl_listener commit;
 	struct wl_listener request_state;
 	struct wl_listener destroy;
 	struct wl_listener frame;
+	struct wl_listener present;
+
+	int shared_state_slot;
+	struct cg_frame_stats frame_stats;
+	/* Locked buffer of the last commit, for snapshots */
+	struct wlr_buffer *last_buffer;
+	/* Forced refresh rate in Hz, FORCED_REFRESH_AUTO, or 0 if disabled */
+	int force_refresh_hz;
+	/* Last presentation and the refresh period it reported; 0 if unknown */
+	uint64_t last_present_nsec;
+	uint32_t present_refresh_nsec;
+	/* render_frame requests not served yet; they wait for the pending
+	 * frame, if any, to be presented. */
+	int frame_requests;
+	/* Milliseconds kept before the next vblank to render, OUTPUT_DELAY_AUTO,
+	 * or 0 to render as soon as the frame event arrives */
+	int max_render_time_ms;
+	struct wl_event_source *repaint_timer;
+	/* When repaint_timer fires, 0 if it is not armed */
+	uint64_t repaint_nsec;
+	/* Milliseconds from the commit to frame_done, OUTPUT_DELAY_AUTO, or 0
+	 * to send it right away */
+	int frame_done_delay_ms;
+	struct wl_event_source *frame_done_timer;
+	uint64_t last_frame_done_nsec;
+	/* Frames per second rendered at most, 0 for no cap */
+	int max_fps;
+	/* Nothing was damaged for server->idle_timeout_sec */
+	bool idle;
+	uint64_t last_damage_nsec;
 
 	struct wl_list link; // cg_server::outputs
 };
@@ -28,5 +72,16 @@ void handle_output_manager_test(struct wl_listener *listener, void *data);
 void handle_output_layout_change(struct wl_listener *listener, void *data);
 void handle_new_output(struct wl_listener *listener, void *data);
 void output_set_window_title(struct cg_output *output, const char *title);
+struct cg_output *output_from_name(struct cg_server *server, const char *name);
+void output_request_frame(struct cg_output *output);
+void output_set_lockstep(struct cg_server *server, bool lockstep);
+bool output_parse_refresh(const char *str, int *hz);
+int output_default_refresh(struct cg_output *output);
+void output_set_force_refresh(struct cg_output *output, int hz);
+bool output_parse_delay(const char *str, int *ms);
+void output_set_max_render_time(struct cg_output *output, int ms);
+void output_set_frame_done_delay(struct cg_output *output, int ms);
+void output_set_max_fps(struct cg_output *output, int fps);
+void output_notify_activity(struct cg_server *server);
 
 #endif
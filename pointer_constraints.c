@@ -51,7 +51,7 @@ static void pointer_constraint_set_cursor_position_hint(struct wl_client *client
 	}
 
 	if(constraint->type == CG_POINTER_CONSTRAINT_LOCKED && constraint->remote_locked_pointer) {
-		wlr_log(WLR_INFO, "Warping to (%d, %d)", wl_fixed_to_int(x), wl_fixed_to_int(y));
+		wlr_log(WLR_DEBUG, "Warping to (%d, %d)", wl_fixed_to_int(x), wl_fixed_to_int(y));
 		zwp_locked_pointer_v1_set_cursor_position_hint(constraint->remote_locked_pointer, x, y);
 	}
 }
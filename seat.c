@@ -18,6 +18,8 @@
 #include <wlr/backend.h>
 #include <wlr/backend/multi.h>
 #include <wlr/backend/session.h>
+#include <wlr/interfaces/wlr_keyboard.h>
+#include <wlr/interfaces/wlr_pointer.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_idle_notify_v1.h>
@@ -38,8 +40,10 @@
 #include "output.h"
 #include "seat.h"
 #include "server.h"
+#include "shared_state.h"
 #include "view.h"
 #include "clipboard_sync.h"
+#include "ipc.h"
 #if CAGE_HAS_XWAYLAND
 #include "xwayland.h"
 #endif
@@ -245,13 +249,21 @@ handle_virtual_pointer(struct wl_listener *listener, void *data)
 	update_capabilities(seat);
 }
 
+/* Input wakes the idle notifier up, and outputs from their idle mode. */
+static void
+seat_notify_activity(struct cg_seat *seat)
+{
+	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	output_notify_activity(seat->server);
+}
+
 static void
 handle_modifier_event(struct wlr_keyboard *keyboard, struct cg_seat *seat)
 {
 	wlr_seat_set_keyboard(seat->seat, keyboard);
 	wlr_seat_keyboard_notify_modifiers(seat->seat, &keyboard->modifiers);
 
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static bool
@@ -273,7 +285,7 @@ handle_keybinding(struct cg_server *server, xkb_keysym_t sym)
 	} else {
 		return false;
 	}
-	wlr_idle_notifier_v1_notify_activity(server->idle, server->seat->seat);
+	seat_notify_activity(server->seat);
 	return true;
 }
 
@@ -305,7 +317,7 @@ handle_key_event(struct wlr_keyboard *keyboard, struct cg_seat *seat, void *data
 		wlr_seat_keyboard_notify_key(seat->seat, event->time_msec, event->keycode, event->state);
 	}
 
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -514,7 +526,7 @@ handle_touch_down(struct wl_listener *listener, void *data)
 		press_cursor_button(seat, &event->touch->base, event->time_msec, BTN_LEFT, WLR_BUTTON_PRESSED, lx, ly);
 	}
 
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -533,7 +545,7 @@ handle_touch_up(struct wl_listener *listener, void *data)
 	}
 
 	wlr_seat_touch_notify_up(seat->seat, event->time_msec, event->touch_id);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -565,7 +577,7 @@ handle_touch_motion(struct wl_listener *listener, void *data)
 		seat->touch_ly = ly;
 	}
 
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -574,7 +586,7 @@ handle_touch_frame(struct wl_listener *listener, void *data)
 	struct cg_seat *seat = wl_container_of(listener, seat, touch_frame);
 
 	wlr_seat_touch_notify_frame(seat->seat);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -583,7 +595,7 @@ handle_cursor_frame(struct wl_listener *listener, void *data)
 	struct cg_seat *seat = wl_container_of(listener, seat, cursor_frame);
 
 	wlr_seat_pointer_notify_frame(seat->seat);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -594,7 +606,7 @@ handle_cursor_axis(struct wl_listener *listener, void *data)
 
 	wlr_seat_pointer_notify_axis(seat->seat, event->time_msec, event->orientation, event->delta,
 				     event->delta_discrete, event->source, event->relative_direction);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -606,7 +618,7 @@ handle_cursor_button(struct wl_listener *listener, void *data)
 	wlr_seat_pointer_notify_button(seat->seat, event->time_msec, event->button, event->state);
 	press_cursor_button(seat, &event->pointer->base, event->time_msec, event->button, event->state, seat->cursor->x,
 			    seat->cursor->y);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -636,7 +648,13 @@ process_cursor_motion(struct cg_seat *seat, uint32_t time_msec, double dx, doubl
 		drag_icon_update_position(drag_icon);
 	}
 
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	/* Focus changes refresh the pointer focus with a made-up time; the
+	 * cursor did not move, so subscribers are not told. */
+	if (time_msec != (uint32_t) -1) {
+		shared_state_update_cursor(seat->server, time_msec);
+		ipc_notify_cursor_motion(seat->server, time_msec);
+	}
+	seat_notify_activity(seat);
 }
 
 static void
@@ -653,7 +671,7 @@ handle_cursor_motion_absolute(struct wl_listener *listener, void *data)
 
 	wlr_cursor_warp_absolute(seat->cursor, &event->pointer->base, event->x, event->y);
 	process_cursor_motion(seat, event->time_msec, dx, dy, dx, dy);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -665,7 +683,7 @@ handle_cursor_motion_relative(struct wl_listener *listener, void *data)
 	wlr_cursor_move(seat->cursor, &event->pointer->base, event->delta_x, event->delta_y);
 	process_cursor_motion(seat, event->time_msec, event->delta_x, event->delta_y, event->unaccel_dx,
 			      event->unaccel_dy);
-	wlr_idle_notifier_v1_notify_activity(seat->server->idle, seat->seat);
+	seat_notify_activity(seat);
 }
 
 static void
@@ -792,6 +810,11 @@ handle_destroy(struct wl_listener *listener, void *data)
 	}
 	wl_list_remove(&seat->new_input.link);
 
+	if (seat->ipc_input) {
+		wlr_pointer_finish(&seat->ipc_pointer);
+		wlr_keyboard_finish(&seat->ipc_keyboard);
+	}
+
 	wlr_xcursor_manager_destroy(seat->xcursor_manager);
 	if (seat->cursor) {
 		wlr_cursor_destroy(seat->cursor);
@@ -942,6 +965,7 @@ seat_set_focus(struct cg_seat *seat, struct cg_view *view)
 	}
 
 	view_activate(view, true);
+	ipc_notify_view(view, CG_IPC_VIEW_FOCUS);
 	char *title = view_get_title(view);
 	struct cg_output *output;
 	wl_list_for_each (output, &server->outputs, link) {
@@ -956,6 +980,7 @@ seat_set_focus(struct cg_seat *seat, struct cg_view *view)
 	} else {
 		wlr_seat_keyboard_notify_enter(wlr_seat, view->wlr_surface, NULL, 0, NULL);
 	}
+	shared_state_update_focus(server);
 
 	process_cursor_motion(seat, -1, 0, 0, 0, 0);
 }
@@ -968,3 +993,132 @@ seat_center_cursor(struct cg_seat *seat)
 	wlr_output_layout_get_box(seat->server->output_layout, NULL, &layout_box);
 	wlr_cursor_warp(seat->cursor, NULL, layout_box.width / 2, layout_box.height / 2);
 }
+
+/* Moves the cursor to a position in layout coordinates and updates pointer
+ * focus. Returns false if the position is outside of the layout. Without
+ * relative_motion, clients using relative pointer events,
+ * typically games, do not see the jump. */
+bool
+seat_warp_cursor(struct cg_seat *seat, double lx, double ly, bool relative_motion)
+{
+	double old_x = seat->cursor->x;
+	double old_y = seat->cursor->y;
+	if (!wlr_cursor_warp(seat->cursor, NULL, lx, ly)) {
+		return false;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t time_msec = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	double dx = relative_motion ? seat->cursor->x - old_x : 0;
+	double dy = relative_motion ? seat->cursor->y - old_y : 0;
+	process_cursor_motion(seat, time_msec, dx, dy, dx, dy);
+	wlr_seat_pointer_notify_frame(seat->seat);
+	return true;
+}
+
+static const struct wlr_pointer_impl ipc_pointer_impl = {
+	.name = "cage-ipc-pointer",
+};
+
+static const struct wlr_keyboard_impl ipc_keyboard_impl = {
+	.name = "cage-ipc-keyboard",
+};
+
+/* Injected events go through the same wlr_cursor and keyboard group paths
+ * as real devices, so they are indistinguishable to clients. */
+static void
+seat_init_ipc_input(struct cg_seat *seat)
+{
+	wlr_pointer_init(&seat->ipc_pointer, &ipc_pointer_impl, ipc_pointer_impl.name);
+	handle_new_pointer(seat, &seat->ipc_pointer);
+	wlr_keyboard_init(&seat->ipc_keyboard, &ipc_keyboard_impl, ipc_keyboard_impl.name);
+	handle_new_keyboard(seat, &seat->ipc_keyboard, true);
+	update_capabilities(seat);
+	seat->ipc_input = true;
+}
+
+void
+seat_inject_input(struct cg_seat *seat, const struct cg_input_event *events, size_t count)
+{
+	if (!seat->ipc_input) {
+		seat_init_ipc_input(seat);
+	}
+
+	struct wlr_pointer *pointer = &seat->ipc_pointer;
+	bool pointer_frame = false;
+	for (size_t i = 0; i < count; i++) {
+		const struct cg_input_event *event = &events[i];
+		switch (event->type) {
+		case CG_INPUT_EVENT_MOTION: {
+			struct wlr_pointer_motion_event motion = {
+				.pointer = pointer,
+				.time_msec = event->time_msec,
+				.delta_x = event->x,
+				.delta_y = event->y,
+				.unaccel_dx = event->x,
+				.unaccel_dy = event->y,
+			};
+			wl_signal_emit_mutable(&pointer->events.motion, &motion);
+			pointer_frame = true;
+			break;
+		}
+		case CG_INPUT_EVENT_MOTION_ABSOLUTE: {
+			struct wlr_pointer_motion_absolute_event motion = {
+				.pointer = pointer,
+				.time_msec = event->time_msec,
+				.x = event->x,
+				.y = event->y,
+			};
+			wl_signal_emit_mutable(&pointer->events.motion_absolute, &motion);
+			pointer_frame = true;
+			break;
+		}
+		case CG_INPUT_EVENT_BUTTON: {
+			struct wlr_pointer_button_event button = {
+				.pointer = pointer,
+				.time_msec = event->time_msec,
+				.button = event->code,
+				.state = event->state ? WL_POINTER_BUTTON_STATE_PRESSED : WL_POINTER_BUTTON_STATE_RELEASED,
+			};
+			wl_signal_emit_mutable(&pointer->events.button, &button);
+			pointer_frame = true;
+			break;
+		}
+		case CG_INPUT_EVENT_AXIS: {
+			struct wlr_pointer_axis_event axis = {
+				.pointer = pointer,
+				.time_msec = event->time_msec,
+				.source = WL_POINTER_AXIS_SOURCE_WHEEL,
+				.orientation = event->code == WL_POINTER_AXIS_HORIZONTAL_SCROLL
+						       ? WL_POINTER_AXIS_HORIZONTAL_SCROLL
+						       : WL_POINTER_AXIS_VERTICAL_SCROLL,
+				.relative_direction = WL_POINTER_AXIS_RELATIVE_DIRECTION_IDENTICAL,
+				.delta = event->x,
+				.delta_discrete = (int32_t) event->y,
+			};
+			wl_signal_emit_mutable(&pointer->events.axis, &axis);
+			pointer_frame = true;
+			break;
+		}
+		case CG_INPUT_EVENT_KEY: {
+			struct wlr_keyboard_key_event key = {
+				.time_msec = event->time_msec,
+				.keycode = event->code,
+				.update_state = true,
+				.state = event->state ? WL_KEYBOARD_KEY_STATE_PRESSED : WL_KEYBOARD_KEY_STATE_RELEASED,
+			};
+			wlr_keyboard_notify_key(&seat->ipc_keyboard, &key);
+			break;
+		}
+		default:
+			wlr_log(WLR_DEBUG, "Ignoring injected input event of unknown type %u", event->type);
+			break;
+		}
+	}
+
+	if (pointer_frame) {
+		wl_signal_emit_mutable(&pointer->events.frame, pointer);
+	}
+}
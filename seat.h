@@ -5,6 +5,8 @@
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_input_device.h>
+#include <wlr/types/wlr_keyboard.h>
+#include <wlr/types/wlr_pointer.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 
@@ -45,6 +47,11 @@ struct cg_seat {
 	struct wl_listener request_start_drag;
 	struct wl_listener start_drag;
 
+	/* Devices backing input injected over IPC, set up on first use */
+	bool ipc_input;
+	struct wlr_pointer ipc_pointer;
+	struct wlr_keyboard ipc_keyboard;
+
 	struct wl_listener request_set_cursor;
 	struct wl_listener request_set_selection;
 	struct wl_listener request_set_primary_selection;
@@ -87,10 +94,30 @@ struct cg_drag_icon {
 	struct wl_listener destroy;
 };
 
+enum cg_input_event_type {
+	CG_INPUT_EVENT_MOTION = 1, // relative motion by (x, y)
+	CG_INPUT_EVENT_MOTION_ABSOLUTE, // (x, y) in [0, 1] across the layout
+	CG_INPUT_EVENT_BUTTON, // code: BTN_* from linux/input-event-codes.h
+	CG_INPUT_EVENT_AXIS, // code: wl_pointer_axis, x: delta, y: discrete delta in 1/120ths
+	CG_INPUT_EVENT_KEY, // code: KEY_* from linux/input-event-codes.h
+};
+
+/* Wire format of the inject_input IPC command. state is 1 for a press and
+ * 0 for a release. */
+struct cg_input_event {
+	uint32_t type;
+	uint32_t time_msec;
+	uint32_t code;
+	uint32_t state;
+	double x, y;
+};
+
 struct cg_seat *seat_create(struct cg_server *server, struct wlr_backend *backend);
 void seat_destroy(struct cg_seat *seat);
 struct cg_view *seat_get_focus(struct cg_seat *seat);
 void seat_set_focus(struct cg_seat *seat, struct cg_view *view);
 void seat_center_cursor(struct cg_seat *seat);
+bool seat_warp_cursor(struct cg_seat *seat, double lx, double ly, bool relative_motion);
+void seat_inject_input(struct cg_seat *seat, const struct cg_input_event *events, size_t count);
 
 #endif
@@ -17,6 +17,14 @@
 #endif
 
 struct cg_clipboard_sync;
+struct cg_ipc;
+struct cg_shared_state;
+
+/* Forced refresh rate requested with -r, for one output or all of them. */
+struct cg_refresh_rule {
+	const char *output; // NULL for the default rule
+	int hz;
+};
 
 enum cg_multi_output_mode {
 	CAGE_MULTI_OUTPUT_MODE_EXTEND,
@@ -26,6 +34,7 @@ enum cg_multi_output_mode {
 struct cg_server {
 	struct wl_display *wl_display;
 	struct wl_list views;
+	uint32_t next_view_id;
 	struct wlr_backend *backend;
 	struct wlr_renderer *renderer;
 	struct wlr_allocator *allocator;
@@ -68,15 +77,38 @@ struct cg_server {
 	struct wlr_output_manager_v1 *output_manager_v1;
 	struct wl_listener output_manager_apply;
 	struct wl_listener output_manager_test;
+	/* An output configuration is being applied: per-output updates are
+	 * deferred to its end. */
+	bool output_config_pending;
 
 	struct wlr_relative_pointer_manager_v1 *relative_pointer_manager;
 
+	struct cg_ipc *ipc;
+	struct cg_shared_state *shared_state;
+
 	bool xdg_decoration;
 	bool allow_vt_switch;
 	bool return_app_code;
 	bool terminated;
 	enum wlr_log_importance log_level;
+	struct wl_array refresh_rules; // cg_refresh_rule
+	/* Set by enable/disable_force_refresh over IPC: outputs, including
+	 * those added later, then follow force_refresh over the rules. */
+	bool force_refresh_override;
 	bool force_refresh;
+	/* Outputs only render when asked to over IPC (render_frame). */
+	bool lockstep;
+	/* Rate at which clients of hidden nested outputs get frame events, 0
+	 * to let them stall */
+	int offscreen_hz;
+	/* Default max render time of outputs, see cg_output */
+	int max_render_time_ms;
+	int frame_done_delay_ms;
+	int max_fps;
+	/* Seconds without damage before outputs enter idle mode, 0 never */
+	int idle_timeout_sec;
+	bool ipc_seqpacket;
+	const char *ipc_socket;
 	const char *app_id;
 };
 
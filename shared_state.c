@@ -0,0 +1,216 @@
+/*
+ * Cage: A Wayland kiosk.
+ *
+ * See the LICENSE file accompanying this file.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/util/log.h>
+
+#include "output.h"
+#include "seat.h"
+#include "server.h"
+#include "shared_state.h"
+#include "view.h"
+
+struct cg_shared_state {
+	int fd;
+	struct cg_shared_state_page *page;
+};
+
+static uint64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void
+write_begin(struct cg_shared_state_page *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct cg_shared_state_page *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+void
+shared_state_init(struct cg_server *server)
+{
+	struct cg_shared_state *state = calloc(1, sizeof(struct cg_shared_state));
+	if (!state) {
+		wlr_log(WLR_ERROR, "Cannot allocate shared state");
+		return;
+	}
+
+	state->fd = memfd_create("cage-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (state->fd < 0) {
+		wlr_log_errno(WLR_ERROR, "Cannot create shared state memfd");
+		free(state);
+		return;
+	}
+
+	if (ftruncate(state->fd, sizeof(struct cg_shared_state_page)) < 0) {
+		wlr_log_errno(WLR_ERROR, "Cannot size shared state memfd");
+		goto error;
+	}
+
+	state->page = mmap(NULL, sizeof(struct cg_shared_state_page), PROT_READ | PROT_WRITE, MAP_SHARED, state->fd, 0);
+	if (state->page == MAP_FAILED) {
+		wlr_log_errno(WLR_ERROR, "Cannot map shared state memfd");
+		goto error;
+	}
+
+	/* Readers get the same fd: make sure they cannot resize it or, where
+	 * supported, map it writable. Our own mapping is not affected. */
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+	seals |= F_SEAL_FUTURE_WRITE;
+#endif
+	if (fcntl(state->fd, F_ADD_SEALS, seals) < 0) {
+		wlr_log_errno(WLR_DEBUG, "Cannot seal shared state memfd");
+	}
+
+	state->page->version = CG_SHARED_STATE_VERSION;
+	server->shared_state = state;
+	return;
+
+error:
+	close(state->fd);
+	free(state);
+}
+
+/* Readers keep their own mappings; the page lives on until they unmap it. */
+void
+shared_state_finish(struct cg_server *server)
+{
+	struct cg_shared_state *state = server->shared_state;
+	if (!state) {
+		return;
+	}
+
+	munmap(state->page, sizeof(struct cg_shared_state_page));
+	close(state->fd);
+	free(state);
+	server->shared_state = NULL;
+}
+
+int
+shared_state_get_fd(struct cg_server *server)
+{
+	return server->shared_state ? server->shared_state->fd : -1;
+}
+
+void
+shared_state_update_cursor(struct cg_server *server, uint32_t time_msec)
+{
+	if (!server->shared_state) {
+		return;
+	}
+
+	struct cg_shared_state_page *page = server->shared_state->page;
+	struct cg_view *focus = seat_get_focus(server->seat);
+
+	write_begin(page);
+	page->cursor_x = server->seat->cursor->x;
+	page->cursor_y = server->seat->cursor->y;
+	page->cursor_time_msec = time_msec;
+	page->focused_view = focus ? focus->id : 0;
+	write_end(page);
+}
+
+void
+shared_state_update_focus(struct cg_server *server)
+{
+	if (!server->shared_state) {
+		return;
+	}
+
+	struct cg_shared_state_page *page = server->shared_state->page;
+	struct cg_view *focus = seat_get_focus(server->seat);
+
+	write_begin(page);
+	page->focused_view = focus ? focus->id : 0;
+	write_end(page);
+}
+
+void
+shared_state_add_output(struct cg_output *output)
+{
+	struct cg_shared_state *state = output->server->shared_state;
+	output->shared_state_slot = -1;
+	if (!state) {
+		return;
+	}
+
+	for (int i = 0; i < CG_SHARED_STATE_MAX_OUTPUTS; i++) {
+		struct cg_shared_state_output *slot = &state->page->outputs[i];
+		if (slot->name[0] != '\0') {
+			continue;
+		}
+
+		write_begin(state->page);
+		memset(slot, 0, sizeof(*slot));
+		snprintf(slot->name, sizeof(slot->name), "%s", output->wlr_output->name);
+		write_end(state->page);
+		output->shared_state_slot = i;
+		return;
+	}
+
+	wlr_log(WLR_INFO, "No shared state slot left for output %s", output->wlr_output->name);
+}
+
+void
+shared_state_remove_output(struct cg_output *output)
+{
+	struct cg_shared_state *state = output->server->shared_state;
+	if (!state || output->shared_state_slot < 0) {
+		return;
+	}
+
+	write_begin(state->page);
+	memset(&state->page->outputs[output->shared_state_slot], 0, sizeof(struct cg_shared_state_output));
+	write_end(state->page);
+	output->shared_state_slot = -1;
+}
+
+void
+shared_state_update_frame(struct cg_output *output, const struct timespec *when)
+{
+	struct cg_shared_state *state = output->server->shared_state;
+	if (!state || output->shared_state_slot < 0) {
+		return;
+	}
+
+	write_begin(state->page);
+	state->page->outputs[output->shared_state_slot].frame_nsec = timespec_to_nsec(when);
+	write_end(state->page);
+}
+
+void
+shared_state_update_present(struct cg_output *output, const struct wlr_output_event_present *event)
+{
+	struct cg_shared_state *state = output->server->shared_state;
+	if (!state || output->shared_state_slot < 0 || !event->presented || !event->when) {
+		return;
+	}
+
+	struct cg_shared_state_output *slot = &state->page->outputs[output->shared_state_slot];
+	write_begin(state->page);
+	slot->present_nsec = timespec_to_nsec(event->when);
+	slot->present_seq = event->seq;
+	slot->present_refresh_nsec = event->refresh;
+	slot->present_flags = event->flags;
+	write_end(state->page);
+}
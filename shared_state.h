@@ -0,0 +1,51 @@
+#ifndef CG_SHARED_STATE_H
+#define CG_SHARED_STATE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "server.h"
+
+#define CG_SHARED_STATE_VERSION 1
+#define CG_SHARED_STATE_MAX_OUTPUTS 8
+
+struct cg_output;
+struct wlr_output_event_present;
+
+/* Layout of the page handed out by the map_state IPC command.
+ *
+ * The page is protected by a seqlock: seq is odd while the compositor
+ * is writing. Readers load seq (acquire), copy what they need, then
+ * load seq again and retry if it changed or was odd. All timestamps are
+ * CLOCK_MONOTONIC nanoseconds. */
+struct cg_shared_state_output {
+	char name[32]; // empty if the slot is unused
+	uint64_t frame_nsec;
+	uint64_t present_nsec;
+	uint64_t present_seq;
+	uint32_t present_refresh_nsec;
+	uint32_t present_flags;
+};
+
+struct cg_shared_state_page {
+	uint32_t version;
+	uint32_t seq;
+
+	double cursor_x, cursor_y;
+	uint32_t cursor_time_msec;
+	uint32_t focused_view; // cg_view::id, 0 if nothing is focused
+
+	struct cg_shared_state_output outputs[CG_SHARED_STATE_MAX_OUTPUTS];
+};
+
+void shared_state_init(struct cg_server *server);
+void shared_state_finish(struct cg_server *server);
+int shared_state_get_fd(struct cg_server *server);
+void shared_state_update_cursor(struct cg_server *server, uint32_t time_msec);
+void shared_state_update_focus(struct cg_server *server);
+void shared_state_add_output(struct cg_output *output);
+void shared_state_remove_output(struct cg_output *output);
+void shared_state_update_frame(struct cg_output *output, const struct timespec *when);
+void shared_state_update_present(struct cg_output *output, const struct wlr_output_event_present *event);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Cage: A Wayland kiosk.
+ *
+ * See the LICENSE file accompanying this file.
+ */
+
+#define _GNU_SOURCE
+
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/render/wlr_texture.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/util/log.h>
+
+#include "output.h"
+#include "server.h"
+#include "snapshot.h"
+
+static int
+read_buffer(struct cg_server *server, struct wlr_buffer *buffer, struct cg_snapshot *snapshot)
+{
+	struct wlr_texture *texture = wlr_texture_from_buffer(server->renderer, buffer);
+	if (!texture) {
+		wlr_log(WLR_ERROR, "Cannot import buffer for snapshot");
+		return -1;
+	}
+
+	snapshot->width = texture->width;
+	snapshot->height = texture->height;
+	snapshot->stride = texture->width * 4;
+	snapshot->format = DRM_FORMAT_ARGB8888;
+	size_t size = (size_t) snapshot->stride * snapshot->height;
+
+	int fd = memfd_create("cage-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		wlr_log_errno(WLR_ERROR, "Cannot create snapshot memfd");
+		goto error_texture;
+	}
+	if (ftruncate(fd, size) < 0) {
+		wlr_log_errno(WLR_ERROR, "Cannot size snapshot memfd");
+		goto error_fd;
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		wlr_log_errno(WLR_ERROR, "Cannot map snapshot memfd");
+		goto error_fd;
+	}
+
+	bool ok = wlr_texture_read_pixels(texture, &(struct wlr_texture_read_pixels_options){
+							   .data = data,
+							   .format = snapshot->format,
+							   .stride = snapshot->stride,
+						   });
+	munmap(data, size);
+	if (!ok) {
+		wlr_log(WLR_ERROR, "Cannot read snapshot pixels");
+		goto error_fd;
+	}
+
+	/* The snapshot is immutable from now on. */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		wlr_log_errno(WLR_DEBUG, "Cannot seal snapshot memfd");
+	}
+
+	wlr_texture_destroy(texture);
+	return fd;
+
+error_fd:
+	close(fd);
+error_texture:
+	wlr_texture_destroy(texture);
+	return -1;
+}
+
+/* Reads back the buffer last committed on the output, or renders one if
+ * there is none yet. Returns a sealed memfd holding the pixels, or -1. */
+int
+snapshot_output(struct cg_output *output, struct cg_snapshot *snapshot)
+{
+	if (!output->wlr_output->enabled || !output->scene_output) {
+		return -1;
+	}
+
+	if (output->last_buffer) {
+		return read_buffer(output->server, output->last_buffer, snapshot);
+	}
+
+	struct wlr_output_state state;
+	wlr_output_state_init(&state);
+	int fd = -1;
+	if (wlr_scene_output_build_state(output->scene_output, &state, NULL) && state.buffer) {
+		fd = read_buffer(output->server, state.buffer, snapshot);
+	}
+	wlr_output_state_finish(&state);
+	return fd;
+}
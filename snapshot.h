@@ -0,0 +1,17 @@
+#ifndef CG_SNAPSHOT_H
+#define CG_SNAPSHOT_H
+
+#include <stdint.h>
+
+struct cg_output;
+
+struct cg_snapshot {
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format; // DRM fourcc
+};
+
+int snapshot_output(struct cg_output *output, struct cg_snapshot *snapshot);
+
+#endif
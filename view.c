@@ -12,13 +12,16 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <wayland-server-core.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_scene.h>
 
+#include "ipc.h"
 #include "output.h"
 #include "seat.h"
 #include "server.h"
+#include "shared_state.h"
 #include "view.h"
 #if CAGE_HAS_XWAYLAND
 #include "xwayland.h"
@@ -110,15 +113,50 @@ view_position_all(struct cg_server *server)
 	}
 }
 
+/* Commits that long after frame_done come from clients that were idle,
+ * not slow. */
+#define VIEW_RENDER_TIME_MAX_NSEC 100000000
+
+static void
+handle_view_commit(struct wl_listener *listener, void *data)
+{
+	struct cg_view *view = wl_container_of(listener, view, commit);
+	if (view->frame_done_nsec == 0) {
+		return;
+	}
+
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t now_nsec = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	uint64_t sample = now_nsec - view->frame_done_nsec;
+	view->frame_done_nsec = 0;
+	if (sample > VIEW_RENDER_TIME_MAX_NSEC) {
+		return;
+	}
+
+	if (sample > view->render_time_nsec) {
+		view->render_time_nsec = sample;
+	} else {
+		view->render_time_nsec -= (view->render_time_nsec - sample) / 16;
+	}
+}
+
 void
 view_unmap(struct cg_view *view)
 {
+	ipc_notify_view(view, CG_IPC_VIEW_UNMAP);
+
 	wl_list_remove(&view->link);
+	wl_list_remove(&view->commit.link);
 
 	wlr_scene_node_destroy(&view->scene_tree->node);
 
 	view->wlr_surface->data = NULL;
 	view->wlr_surface = NULL;
+
+	/* The keyboard focus, if it was on this view, no longer resolves
+	 * to it. */
+	shared_state_update_focus(view->server);
 }
 
 void
@@ -133,6 +171,9 @@ view_map(struct cg_view *view, struct wlr_surface *surface)
 
 	view->wlr_surface = surface;
 	surface->data = view;
+	view->frame_done_nsec = 0;
+	view->commit.notify = handle_view_commit;
+	wl_signal_add(&surface->events.commit, &view->commit);
 
 #if CAGE_HAS_XWAYLAND
 	/* We shouldn't position override-redirect windows. They set
@@ -144,9 +185,19 @@ view_map(struct cg_view *view, struct wlr_surface *surface)
 	}
 
 	wl_list_insert(&view->server->views, &view->link);
+	ipc_notify_view(view, CG_IPC_VIEW_MAP);
 	seat_set_focus(view->server->seat, view);
 }
 
+void
+view_title_changed(struct cg_view *view)
+{
+	/* Only mapped views are reported. */
+	if (view->wlr_surface) {
+		ipc_notify_view(view, CG_IPC_VIEW_TITLE);
+	}
+}
+
 void
 view_destroy(struct cg_view *view)
 {
@@ -170,6 +221,7 @@ void
 view_init(struct cg_view *view, struct cg_server *server, enum cg_view_type type, const struct cg_view_impl *impl)
 {
 	view->server = server;
+	view->id = ++server->next_view_id;
 	view->type = type;
 	view->impl = impl;
 }
@@ -27,9 +27,18 @@ struct cg_view {
 	struct wlr_surface *wlr_surface;
 	struct wlr_scene_tree *scene_tree;
 
+	/* Unique for the lifetime of the compositor, never 0. */
+	uint32_t id;
+
 	/* The view has a position in layout coordinates. */
 	int lx, ly;
 
+	/* When frame_done was last sent, and a decaying maximum of the time
+	 * the client took from there to its next commit. */
+	uint64_t frame_done_nsec;
+	uint64_t render_time_nsec;
+	struct wl_listener commit;
+
 	enum cg_view_type type;
 	const struct cg_view_impl *impl;
 };
@@ -52,6 +61,7 @@ void view_position(struct cg_view *view);
 void view_position_all(struct cg_server *server);
 void view_unmap(struct cg_view *view);
 void view_map(struct cg_view *view, struct wlr_surface *surface);
+void view_title_changed(struct cg_view *view);
 void view_destroy(struct cg_view *view);
 void view_init(struct cg_view *view, struct cg_server *server, enum cg_view_type type, const struct cg_view_impl *impl);
 
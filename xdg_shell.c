@@ -219,6 +219,13 @@ handle_xdg_shell_surface_map(struct wl_listener *listener, void *data)
 	view_map(view, xdg_shell_view->xdg_toplevel->base->surface);
 }
 
+static void
+handle_xdg_shell_surface_set_title(struct wl_listener *listener, void *data)
+{
+	struct cg_xdg_shell_view *xdg_shell_view = wl_container_of(listener, xdg_shell_view, set_title);
+	view_title_changed(&xdg_shell_view->view);
+}
+
 static void
 handle_xdg_shell_surface_commit(struct wl_listener *listener, void *data)
 {
@@ -244,6 +251,7 @@ handle_xdg_shell_surface_destroy(struct wl_listener *listener, void *data)
 	wl_list_remove(&xdg_shell_view->unmap.link);
 	wl_list_remove(&xdg_shell_view->destroy.link);
 	wl_list_remove(&xdg_shell_view->request_fullscreen.link);
+	wl_list_remove(&xdg_shell_view->set_title.link);
 	xdg_shell_view->xdg_toplevel = NULL;
 
 	view_destroy(view);
@@ -284,6 +292,8 @@ handle_new_xdg_toplevel(struct wl_listener *listener, void *data)
 	wl_signal_add(&toplevel->events.destroy, &xdg_shell_view->destroy);
 	xdg_shell_view->request_fullscreen.notify = handle_xdg_shell_surface_request_fullscreen;
 	wl_signal_add(&toplevel->events.request_fullscreen, &xdg_shell_view->request_fullscreen);
+	xdg_shell_view->set_title.notify = handle_xdg_shell_surface_set_title;
+	wl_signal_add(&toplevel->events.set_title, &xdg_shell_view->set_title);
 
 	toplevel->base->data = xdg_shell_view;
 }
@@ -110,6 +110,13 @@ handle_xwayland_surface_request_fullscreen(struct wl_listener *listener, void *d
 	wlr_xwayland_surface_set_fullscreen(xwayland_view->xwayland_surface, xwayland_surface->fullscreen);
 }
 
+static void
+handle_xwayland_surface_set_title(struct wl_listener *listener, void *data)
+{
+	struct cg_xwayland_view *xwayland_view = wl_container_of(listener, xwayland_view, set_title);
+	view_title_changed(&xwayland_view->view);
+}
+
 static void
 handle_xwayland_surface_unmap(struct wl_listener *listener, void *data)
 {
@@ -141,6 +148,7 @@ handle_xwayland_surface_destroy(struct wl_listener *listener, void *data)
 
 	wl_list_remove(&xwayland_view->destroy.link);
 	wl_list_remove(&xwayland_view->request_fullscreen.link);
+	wl_list_remove(&xwayland_view->set_title.link);
 	xwayland_view->xwayland_surface = NULL;
 
 	view_destroy(view);
@@ -199,4 +207,6 @@ handle_xwayland_surface_new(struct wl_listener *listener, void *data)
 	wl_signal_add(&xwayland_surface->events.destroy, &xwayland_view->destroy);
 	xwayland_view->request_fullscreen.notify = handle_xwayland_surface_request_fullscreen;
 	wl_signal_add(&xwayland_surface->events.request_fullscreen, &xwayland_view->request_fullscreen);
+	xwayland_view->set_title.notify = handle_xwayland_surface_set_title;
+	wl_signal_add(&xwayland_surface->events.set_title, &xwayland_view->set_title);
 }
@@ -15,6 +15,7 @@ struct cg_xwayland_view {
 	struct wl_listener unmap;
 	struct wl_listener map;
 	struct wl_listener request_fullscreen;
+	struct wl_listener set_title;
 };
 
 struct cg_xwayland_view *xwayland_view_from_view(struct cg_view *view);